@@ -1,30 +1,55 @@
 #include <linux/cdev.h>
 #include <linux/ctype.h>
 #include <linux/device.h>
+#include <linux/err.h>
 #include <linux/filter.h>
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "parser.h"
 
+#define CREATE_TRACE_POINTS
+#include "lab1_trace.h"
+
 /*
  * equation parser structs and functions
  */
 
-static int parse_equation(const char *equation)
+#define BUF_SIZE 128
+
+/* Stores the value of equation in *res, returns a negative errno if it is malformed */
+static int parse_equation(const char *equation, int *res)
 {
-    int res;
+    struct parser parser;
     int postfix[PARSER_CAPACITY];
-    int count = infix_to_postfix(equation, postfix);
-    res = postfix_to_eval(postfix, count);
-    return res;
+    int count, err;
+
+    trace_lab1_parse_start(equation);
+    count = infix_to_postfix(&parser, equation, postfix);
+    trace_lab1_parse_end(count);
+    if (count < 0)
+    {
+        return count;
+    }
+
+    trace_lab1_eval_start(count);
+    err = postfix_to_eval(&parser, postfix, count, res);
+    trace_lab1_eval_end(count, err ? err : *res);
+    return err;
 }
 
 /*
@@ -39,17 +64,35 @@ static size_t message_len = sizeof(START_MESSAGE);
 
 static struct proc_dir_entry *lab1_file;
 
+static void append_result(int res)
+{
+    char number[BUF_SIZE];
+    size_t len = sprintf(number, "%d\n", res);
+
+    // message_len counts the terminating zero, so it never passes MESSAGE_SIZE
+    if (message_len + len <= MESSAGE_SIZE)
+    {
+        strcat(message, number);
+        message_len += len;
+    }
+    else
+    {
+        pr_info("Not enough space to write new information\n");
+    }
+}
+
 static ssize_t lab1_read(struct file *file_ptr, char __user *ubuffer, size_t buf_length, loff_t *offset)
 {
-    size_t len = min(message_len - (size_t)*offset, buf_length);
+    size_t len;
 
     pr_info("Proc file read\n");
 
-    if (len <= 0)
+    if (*offset < 0 || *offset >= message_len)
     {
         pr_info("All done\n");
         return 0;
     }
+    len = min(message_len - (size_t)*offset, buf_length);
 
     if (copy_to_user(ubuffer, message + *offset, len))
     {
@@ -74,6 +117,290 @@ static const struct file_operations proc_file_ops = {
     .read = lab1_read};
 #endif
 
+/*
+ * async evaluation structs and functions
+ *
+ * With async=1 a write only copies the expression into a slot of the
+ * submission ring and pushes it onto the lock-free list of a CPU; every
+ * async_batch expressions go to the next online CPU. A per-CPU work item
+ * evaluates everything queued on its CPU as one batch and marks the
+ * slots done.
+ *
+ * The same ring, indexed by the submission sequence number, is the
+ * completion queue. Whoever finds the oldest unpublished slot done
+ * publishes it and the ones after it, so results become readable in
+ * submission order. Reading the device consumes published results as
+ * "<seq> <result>" lines, or "<seq> error <errno>" for a malformed
+ * expression; seq counts writes from 0 since the module was loaded.
+ * /proc/var2 only collects results in synchronous mode.
+ *
+ * A slot is free again only once its result was read, so at most
+ * async_depth expressions are submitted and not yet consumed. Writers
+ * block (or get EAGAIN with O_NONBLOCK) beyond that, and nothing is ever
+ * dropped, so the device is not exclusive in this mode: the results can
+ * be read through another open. fsync waits until everything submitted
+ * is published.
+ */
+
+static bool async = false;
+module_param(async, bool, 0444);
+MODULE_PARM_DESC(async, "evaluate expressions on worker threads");
+
+static unsigned int async_depth = 1024;
+module_param(async_depth, uint, 0444);
+MODULE_PARM_DESC(async_depth, "most expressions submitted and not yet read in async mode");
+
+static unsigned int async_batch = 16;
+module_param(async_batch, uint, 0644);
+MODULE_PARM_DESC(async_batch, "expressions queued on one CPU before moving to the next");
+
+struct lab1_slot
+{
+    struct llist_node node;
+    bool done; // result is valid, set by the worker, cleared when read
+    int result;
+    int err; // parse_equation failed, result is not set
+    char text[BUF_SIZE];
+};
+
+struct lab1_worker
+{
+    struct llist_head queue;
+    struct work_struct work;
+};
+
+static DEFINE_PER_CPU(struct lab1_worker, lab1_workers);
+static struct workqueue_struct *eval_wq;
+
+static struct lab1_slot *ring;
+static unsigned long ring_mask;
+static atomic64_t sq_seq = ATOMIC64_INIT(0); // next sequence number to submit
+static DEFINE_SPINLOCK(cq_lock);
+static u64 cq_tail;                        // next sequence number to publish, under cq_lock
+static u64 cq_head;                        // next sequence number to read, under cq_lock
+static atomic_t inflight = ATOMIC_INIT(0); // submitted and not yet read
+static DECLARE_WAIT_QUEUE_HEAD(sq_wait);   // writers waiting for a free slot
+static DECLARE_WAIT_QUEUE_HEAD(cq_wait);   // readers and fsync waiting for results
+static int submit_cpu;
+
+/* Publishes done slots in sequence order */
+static void lab1_publish(void)
+{
+    bool published = false;
+
+    spin_lock(&cq_lock);
+    while (cq_tail != (u64)atomic64_read(&sq_seq) && smp_load_acquire(&ring[cq_tail & ring_mask].done))
+    {
+        WRITE_ONCE(cq_tail, cq_tail + 1);
+        published = true;
+    }
+    spin_unlock(&cq_lock);
+
+    if (published)
+    {
+        wake_up_all(&cq_wait);
+    }
+}
+
+static bool lab1_cq_ready(void)
+{
+    return READ_ONCE(cq_tail) != READ_ONCE(cq_head);
+}
+
+#define LAB1_CQE_MAX 48 // longest "<seq> error <errno>\n" line, u64 and int
+
+/* Formats published results into buf as whole lines and frees their slots */
+static size_t lab1_consume(char *buf, size_t size)
+{
+    size_t len = 0;
+    int consumed = 0;
+
+    spin_lock(&cq_lock);
+    while (cq_head != cq_tail)
+    {
+        struct lab1_slot *slot = &ring[cq_head & ring_mask];
+        char line[LAB1_CQE_MAX];
+        int n = slot->err ? scnprintf(line, sizeof(line), "%llu error %d\n", (unsigned long long)cq_head, slot->err)
+                          : scnprintf(line, sizeof(line), "%llu %d\n", (unsigned long long)cq_head, slot->result);
+
+        if (len + n > size)
+        {
+            break;
+        }
+        memcpy(buf + len, line, n);
+        len += n;
+        slot->done = false;
+        WRITE_ONCE(cq_head, cq_head + 1);
+        consumed++;
+    }
+    spin_unlock(&cq_lock);
+
+    if (consumed)
+    {
+        // the slots may be reused as soon as inflight drops
+        smp_mb__before_atomic();
+        atomic_sub(consumed, &inflight);
+        wake_up_all(&sq_wait);
+    }
+    return len;
+}
+
+static ssize_t lab1_complete(struct file *f, char __user *ubuffer, size_t buf_length)
+{
+    size_t size = min_t(size_t, buf_length, PAGE_SIZE);
+    ssize_t ret = 0;
+    char *buf;
+
+    if (size < LAB1_CQE_MAX)
+    {
+        return -EINVAL;
+    }
+    buf = kmalloc(size, GFP_KERNEL);
+    if (buf == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    // another reader sharing the file may take the results first
+    while (ret == 0)
+    {
+        if (!lab1_cq_ready())
+        {
+            if (f->f_flags & O_NONBLOCK)
+            {
+                ret = -EAGAIN;
+                break;
+            }
+            if (wait_event_interruptible(cq_wait, lab1_cq_ready()))
+            {
+                ret = -ERESTARTSYS;
+                break;
+            }
+        }
+        ret = lab1_consume(buf, size);
+    }
+
+    if (ret > 0 && copy_to_user(ubuffer, buf, ret))
+    {
+        ret = -EFAULT;
+    }
+    kfree(buf);
+    return ret;
+}
+
+static void lab1_eval_work(struct work_struct *work)
+{
+    struct lab1_worker *w = container_of(work, struct lab1_worker, work);
+    struct llist_node *batch = llist_reverse_order(llist_del_all(&w->queue));
+    struct lab1_slot *slot, *tmp;
+
+    llist_for_each_entry_safe(slot, tmp, batch, node)
+    {
+        slot->err = parse_equation(slot->text, &slot->result);
+        smp_store_release(&slot->done, true);
+    }
+    lab1_publish();
+}
+
+/* Picks the CPU for sequence number seq, moving on every async_batch */
+static int lab1_target_cpu(u64 seq)
+{
+    unsigned int batch = max(READ_ONCE(async_batch), 1U);
+    int cpu = READ_ONCE(submit_cpu);
+
+    if (do_div(seq, batch) == 0)
+    {
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+        {
+            cpu = cpumask_first(cpu_online_mask);
+        }
+        WRITE_ONCE(submit_cpu, cpu);
+    }
+    return cpu;
+}
+
+static ssize_t lab1_submit(struct file *f, const char __user *ubuffer, size_t buf_length)
+{
+    char text[BUF_SIZE];
+    size_t len = min(buf_length, (size_t)BUF_SIZE - 1);
+    struct lab1_worker *w;
+    struct lab1_slot *slot;
+    u64 seq;
+    int cpu;
+
+    // fault in the expression before taking a slot that must complete
+    if (copy_from_user(text, ubuffer, len))
+    {
+        return -EFAULT;
+    }
+    text[len] = '\0';
+
+    if (f->f_flags & O_NONBLOCK)
+    {
+        if (!atomic_add_unless(&inflight, 1, async_depth))
+        {
+            return -EAGAIN;
+        }
+    }
+    else if (wait_event_interruptible(sq_wait, atomic_add_unless(&inflight, 1, async_depth)))
+    {
+        return -ERESTARTSYS;
+    }
+
+    // at most async_depth sequence numbers are unread, so the slot is free
+    seq = atomic64_inc_return(&sq_seq) - 1;
+    slot = &ring[seq & ring_mask];
+    memcpy(slot->text, text, len + 1);
+
+    cpu = lab1_target_cpu(seq);
+    w = per_cpu_ptr(&lab1_workers, cpu);
+    llist_add(&slot->node, &w->queue);
+    queue_work_on(cpu, eval_wq, &w->work);
+    return len;
+}
+
+static int lab1_async_init(void)
+{
+    int cpu;
+
+    async_depth = clamp(async_depth, 1U, 1U << 20);
+    ring_mask = roundup_pow_of_two(async_depth) - 1;
+    ring = vzalloc((ring_mask + 1) * sizeof(*ring));
+    if (ring == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    eval_wq = alloc_workqueue("lab1_eval", 0, 0);
+    if (eval_wq == NULL)
+    {
+        vfree(ring);
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct lab1_worker *w = per_cpu_ptr(&lab1_workers, cpu);
+
+        init_llist_head(&w->queue);
+        INIT_WORK(&w->work, lab1_eval_work);
+    }
+    submit_cpu = cpumask_first(cpu_online_mask);
+    return 0;
+}
+
+/* Called once no writer can submit any more */
+static void lab1_async_cleanup(void)
+{
+    if (!async)
+    {
+        return;
+    }
+    destroy_workqueue(eval_wq);
+    vfree(ring);
+}
+
 /*
  * char dev structs and functions
  */
@@ -83,7 +410,6 @@ static const struct file_operations proc_file_ops = {
 #define DEV_NAME "lab1_dev%d"
 #define DEV_COUNT 4
 
-#define BUF_SIZE 128
 static char number_message[BUF_SIZE];
 
 static dev_t maj_min;
@@ -97,9 +423,13 @@ enum
 
 static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);
 
+/*
+ * Synchronous mode allows a single open. In async mode results must be
+ * read while writing, so a writer and its readers may open separately.
+ */
 static int lab1_dev_open(struct inode *inode, struct file *f)
 {
-    if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
+    if (!async && atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
     {
         return -EBUSY;
     }
@@ -109,50 +439,63 @@ static int lab1_dev_open(struct inode *inode, struct file *f)
 
 static int lab1_dev_release(struct inode *inode, struct file *f)
 {
-    atomic_set(&already_open, CDEV_NOT_USED);
+    if (!async)
+    {
+        atomic_set(&already_open, CDEV_NOT_USED);
+    }
     module_put(THIS_MODULE);
     return 0;
 }
 
 static ssize_t lab1_dev_read(struct file *file_ptr, char __user *ubuffer, size_t buf_length, loff_t *offset)
 {
+    if (async)
+    {
+        return lab1_complete(file_ptr, ubuffer, buf_length);
+    }
     pr_info("%s\n", message);
     return 0;
 }
 
 static ssize_t lab1_dev_write(struct file *file_ptr, const char __user *ubuffer, size_t buf_length, loff_t *offset)
 {
-    char number[BUF_SIZE];
-    size_t len = buf_length;
-    int res;
-
-    pr_info("Write to dev\n");
+    size_t len = min(buf_length, (size_t)BUF_SIZE - 1);
+    int res, err;
 
-    if (buf_length > BUF_SIZE)
+    if (async)
     {
-        len = BUF_SIZE;
+        return lab1_submit(file_ptr, ubuffer, buf_length);
     }
 
     if (copy_from_user(number_message, ubuffer, len))
     {
         return -EFAULT;
     }
+    number_message[len] = '\0';
 
-    res = parse_equation(number_message);
-    sprintf(number, "%d\n", res);
-    message_len += strlen(number);
-    if (message_len < MESSAGE_SIZE)
+    if ((err = parse_equation(number_message, &res)) != 0)
     {
-        strcat(message, number);
+        return err;
     }
-    else
+    append_result(res);
+    return len;
+}
+
+/* In async mode waits until every submitted expression is published */
+static int lab1_dev_fsync(struct file *file_ptr, loff_t start, loff_t end, int datasync)
+{
+    if (!async)
     {
-        pr_info("Not enough space to write new information\n");
+        return 0;
     }
-    return len;
+    return wait_event_interruptible(cq_wait, READ_ONCE(cq_tail) == (u64)atomic64_read(&sq_seq));
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static int cls_uevent(const struct device *dev, struct kobj_uevent_env *env)
+#else
 static int cls_uevent(struct device *dev, struct kobj_uevent_env *env)
+#endif
 {
     add_uevent_var(env, "DEVMODE=%#o", 0666);
     return 0;
@@ -164,7 +507,8 @@ static struct file_operations lab1_dev_fops =
         .open = lab1_dev_open,
         .release = lab1_dev_release,
         .read = lab1_dev_read,
-        .write = lab1_dev_write};
+        .write = lab1_dev_write,
+        .fsync = lab1_dev_fsync};
 
 /*
  * module init and exit
@@ -193,18 +537,30 @@ static int __init lab1_init(void)
 
     pr_info("Loaded lab1 module\n");
 
+    if (async && lab1_async_init() != 0)
+    {
+        pr_alert("Can not set up async evaluation\n");
+        return -ENOMEM;
+    }
+
     if (alloc_chrdev_region(&maj_min, 0, DEV_COUNT, DEVICE_NAME) < 0)
     {
         pr_alert("Can not alloc chrdev region\n");
+        lab1_async_cleanup();
         return -1;
     }
 
     major = MAJOR(maj_min);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    cls = class_create(CLASS_NAME);
+#else
     cls = class_create(THIS_MODULE, CLASS_NAME);
-    if (cls == NULL)
+#endif
+    if (IS_ERR_OR_NULL(cls))
     {
         pr_alert("Can not create class\n");
         unregister_chrdev_region(maj_min, 1);
+        lab1_async_cleanup();
         return -1;
     }
     cls->dev_uevent = cls_uevent;
@@ -225,6 +581,7 @@ static int __init lab1_init(void)
             pr_alert("Can not create device\n");
             cdev_del(&cdevs[i]);
             clear_all_full();
+            lab1_async_cleanup();
             return -1;
         }
 
@@ -237,6 +594,7 @@ static int __init lab1_init(void)
     {
         pr_alert("Can not create file for some reason\n");
         clear_all_full();
+        lab1_async_cleanup();
         return -1;
     }
 
@@ -248,6 +606,7 @@ static void __exit lab1_exit(void)
 {
     proc_remove(lab1_file);
     clear_all_full();
+    lab1_async_cleanup();
     pr_info("Unloaded lab1 module\n");
 }
 
@@ -0,0 +1,94 @@
+/*
+ * Tracepoints of lab1, system "lab1".
+ *
+ * Every expression written to /dev/lab1_dev fires parse_start/parse_end
+ * around infix_to_postfix and eval_start/eval_end around postfix_to_eval,
+ * all on one thread: the writer, or a lab1_eval worker with async=1.
+ * trace/latency.bt pairs them by thread id.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lab1
+
+#if !defined(LAB1_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LAB1_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lab1_parse_start,
+
+    TP_PROTO(const char *expr),
+
+    TP_ARGS(expr),
+
+    TP_STRUCT__entry(
+        __field(size_t, len)
+    ),
+
+    TP_fast_assign(
+        __entry->len = strlen(expr);
+    ),
+
+    TP_printk("len=%zu", __entry->len)
+);
+
+TRACE_EVENT(lab1_parse_end,
+
+    TP_PROTO(int tokens),
+
+    TP_ARGS(tokens),
+
+    TP_STRUCT__entry(
+        __field(int, tokens)
+    ),
+
+    TP_fast_assign(
+        __entry->tokens = tokens;
+    ),
+
+    TP_printk("tokens=%d", __entry->tokens)
+);
+
+TRACE_EVENT(lab1_eval_start,
+
+    TP_PROTO(int tokens),
+
+    TP_ARGS(tokens),
+
+    TP_STRUCT__entry(
+        __field(int, tokens)
+    ),
+
+    TP_fast_assign(
+        __entry->tokens = tokens;
+    ),
+
+    TP_printk("tokens=%d", __entry->tokens)
+);
+
+TRACE_EVENT(lab1_eval_end,
+
+    TP_PROTO(int tokens, int result),
+
+    TP_ARGS(tokens, result),
+
+    TP_STRUCT__entry(
+        __field(int, tokens)
+        __field(int, result)
+    ),
+
+    TP_fast_assign(
+        __entry->tokens = tokens;
+        __entry->result = result;
+    ),
+
+    TP_printk("tokens=%d result=%d", __entry->tokens, __entry->result)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lab1_trace
+#include <trace/define_trace.h>
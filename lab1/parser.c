@@ -1,37 +1,29 @@
 #include <linux/ctype.h>
+#include <linux/errno.h>
+#include <linux/limits.h>
+#include <linux/overflow.h>
 #include <linux/types.h>
 
 #include "parser.h"
 
-typedef enum
+static int push(struct parser *p, int el)
 {
-    NUMBER,
-    OPERATION
-} postfix_info;
-postfix_info info[PARSER_CAPACITY];
-
-static int stack[PARSER_CAPACITY];
-
-int top = -1;
-
-static void push(int el)
-{
-    stack[++top] = el;
-}
-
-static int pop(void)
-{
-    return stack[top--];
+    if (p->top + 1 >= PARSER_CAPACITY)
+    {
+        return -E2BIG;
+    }
+    p->stack[++p->top] = el;
+    return 0;
 }
 
-static bool empty(void)
+static int pop(struct parser *p)
 {
-    return top < 0;
+    return p->stack[p->top--];
 }
 
-static bool is_number(int index)
+static bool empty(const struct parser *p)
 {
-    return info[index] == NUMBER;
+    return p->top < 0;
 }
 
 static int priority(char el)
@@ -47,118 +39,210 @@ static int priority(char el)
     case '/':
         return 2;
     default:
-        return 0;
+        return -1;
+    }
+}
+
+/* Appends one entry to postfix, keeping room for the terminator */
+static int emit(struct parser *p, int *postfix, int *count, int el, bool number)
+{
+    if (*count + 1 >= PARSER_CAPACITY)
+    {
+        return -E2BIG;
+    }
+    p->number[*count] = number;
+    postfix[(*count)++] = el;
+    return 0;
+}
+
+/* Reads the digits at infix[*i] into *value */
+static int parse_number(const char *infix, int *i, int *value)
+{
+    int temp_int = 0;
+
+    while (isdigit(infix[*i]))
+    {
+        if (check_mul_overflow(temp_int, 10, &temp_int) ||
+            check_add_overflow(temp_int, infix[*i] - '0', &temp_int))
+        {
+            return -ERANGE;
+        }
+        (*i)++;
     }
+    *value = temp_int;
+    return 0;
 }
 
-int infix_to_postfix(const char *infix, int *postfix)
+/*
+ * Returns the number of postfix entries, -EINVAL on malformed input,
+ * -E2BIG if the expression does not fit PARSER_CAPACITY and -ERANGE if
+ * a literal does not fit an int.
+ */
+int infix_to_postfix(struct parser *p, const char *infix, int *postfix)
 {
     int i = 0,
         count = 0,
-        temp_int = 0;
+        temp_int,
+        err;
     char el;
 
-    if (infix[i] == '-')
+    p->top = -1;
+    // a leading minus belongs to the first literal
+    if (infix[0] == '-' && isdigit(infix[1]))
     {
         i++;
-        el = infix[i++];
-        while (isdigit(el))
+        if ((err = parse_number(infix, &i, &temp_int)) != 0 ||
+            (err = emit(p, postfix, &count, -temp_int, true)) != 0)
         {
-            temp_int = temp_int * 10 + (el - '0');
-            el = infix[i++];
+            return err;
         }
-
-        info[count] = NUMBER;
-        postfix[count++] = -temp_int;
-        i--;
     }
 
-    while ((el = infix[i++]) != '\0')
+    while ((el = infix[i]) != '\0')
     {
         if (isspace(el))
         {
+            i++;
             continue;
         }
         if (isdigit(el))
         {
-            temp_int = el - '0';
-            while ((el = infix[i++]) != '\0')
+            if ((err = parse_number(infix, &i, &temp_int)) != 0 ||
+                (err = emit(p, postfix, &count, temp_int, true)) != 0)
             {
-                if (isdigit(el))
-                {
-                    temp_int = temp_int * 10 + (el - '0');
-                }
-                else
-                {
-                    break;
-                }
+                return err;
             }
-            info[count] = NUMBER;
-            postfix[count++] = temp_int;
-            i--;
+            continue;
         }
-        else if (el == '(')
+        i++;
+        if (el == '(')
         {
-            push(el);
+            if ((err = push(p, el)) != 0)
+            {
+                return err;
+            }
         }
         else if (el == ')')
         {
-            while (stack[top] != '(')
+            while (!empty(p) && p->stack[p->top] != '(')
             {
-                info[count] = OPERATION;
-                postfix[count++] = pop();
+                if ((err = emit(p, postfix, &count, pop(p), false)) != 0)
+                {
+                    return err;
+                }
             }
-            pop();
+            if (empty(p))
+            {
+                return -EINVAL;
+            }
+            pop(p);
         }
-        else
+        else if (priority(el) > 0)
         {
-            while (!empty() && priority(stack[top]) >= priority(el))
+            while (!empty(p) && priority(p->stack[p->top]) >= priority(el))
             {
-                info[count] = OPERATION;
-                postfix[count++] = pop();
+                if ((err = emit(p, postfix, &count, pop(p), false)) != 0)
+                {
+                    return err;
+                }
+            }
+            if ((err = push(p, el)) != 0)
+            {
+                return err;
             }
-            push(el);
+        }
+        else
+        {
+            return -EINVAL;
         }
     }
-    while (!empty())
+    while (!empty(p))
     {
-        info[count] = OPERATION;
-        postfix[count++] = pop();
+        if (p->stack[p->top] == '(')
+        {
+            return -EINVAL;
+        }
+        if ((err = emit(p, postfix, &count, pop(p), false)) != 0)
+        {
+            return err;
+        }
     }
     postfix[count] = '\0';
     return count;
 }
 
-int postfix_to_eval(const int *postfix, int count)
+/*
+ * Stores the value of the expression in *result. Returns -EINVAL if
+ * operands and operators do not pair up, -EDOM on division by zero and
+ * -ERANGE on overflow.
+ */
+int postfix_to_eval(struct parser *p, const int *postfix, int count, int *result)
 {
-    int i = 0, op1, op2, el;
+    int i = 0, op1, op2, el, res;
+
+    p->top = -1;
     while (i < count)
     {
         el = postfix[i++];
-        if (is_number(i - 1))
+        if (p->number[i - 1])
         {
-            push(el);
+            if (push(p, el) != 0)
+            {
+                return -E2BIG;
+            }
+            continue;
         }
-        else
+
+        if (p->top < 1)
+        {
+            return -EINVAL;
+        }
+        op2 = pop(p);
+        op1 = pop(p);
+        switch (el)
         {
-            op2 = pop();
-            op1 = pop();
-            switch (el)
+        case '+':
+            if (check_add_overflow(op1, op2, &res))
+            {
+                return -ERANGE;
+            }
+            break;
+        case '-':
+            if (check_sub_overflow(op1, op2, &res))
+            {
+                return -ERANGE;
+            }
+            break;
+        case '*':
+            if (check_mul_overflow(op1, op2, &res))
+            {
+                return -ERANGE;
+            }
+            break;
+        case '/':
+            if (op2 == 0)
+            {
+                return -EDOM;
+            }
+            if (op1 == INT_MIN && op2 == -1)
             {
-            case '+':
-                push(op1 + op2);
-                break;
-            case '-':
-                push(op1 - op2);
-                break;
-            case '*':
-                push(op1 * op2);
-                break;
-            case '/':
-                push(op1 / op2);
-                break;
+                return -ERANGE;
             }
+            res = op1 / op2;
+            break;
+        default:
+            return -EINVAL;
         }
+        push(p, res);
+    }
+    if (p->top != 0)
+    {
+        return -EINVAL;
     }
-    return pop();
+    *result = pop(p);
+    return 0;
 }
+
+#ifdef LAB1_KUNIT
+#include "parser_test.c"
+#endif
@@ -1,5 +1,16 @@
 #define PARSER_CAPACITY 100
 
-int infix_to_postfix(const char *infix, int *postfix);
+/*
+ * Working state of one parse. Callers own it, so expressions can be
+ * parsed concurrently.
+ */
+struct parser
+{
+    int stack[PARSER_CAPACITY];
+    int top;
+    bool number[PARSER_CAPACITY]; // whether a postfix entry is an operand
+};
 
-int postfix_to_eval(const int *postfix, int count);
+int infix_to_postfix(struct parser *p, const char *infix, int *postfix);
+
+int postfix_to_eval(struct parser *p, const int *postfix, int count, int *result);
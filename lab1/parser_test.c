@@ -0,0 +1,215 @@
+/*
+ * KUnit suites for the parser, built into lab1_dev.ko with
+ * "make KUNIT=y" and included at the end of parser.c, so the static
+ * helpers are in scope. tests/kunit.sh runs them under UML.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+
+struct parser_test_case
+{
+    const char *expr;
+    int err;
+    int result;
+};
+
+static int parser_test_eval(struct kunit *test, const char *expr, int *res)
+{
+    struct parser *p = kunit_kzalloc(test, sizeof(*p), GFP_KERNEL);
+    int *postfix = kunit_kcalloc(test, PARSER_CAPACITY, sizeof(*postfix), GFP_KERNEL);
+    int count;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, p);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, postfix);
+
+    count = infix_to_postfix(p, expr, postfix);
+    if (count < 0)
+    {
+        return count;
+    }
+    return postfix_to_eval(p, postfix, count, res);
+}
+
+static void parser_test_table(struct kunit *test, const struct parser_test_case *cases, size_t nr)
+{
+    size_t i;
+
+    for (i = 0; i < nr; i++)
+    {
+        int res = 0;
+        int err = parser_test_eval(test, cases[i].expr, &res);
+
+        KUNIT_EXPECT_EQ_MSG(test, err, cases[i].err, "\"%s\"", cases[i].expr);
+        if (err == 0 && cases[i].err == 0)
+        {
+            KUNIT_EXPECT_EQ_MSG(test, res, cases[i].result, "\"%s\"", cases[i].expr);
+        }
+    }
+}
+
+static void parser_test_precedence(struct kunit *test)
+{
+    static const struct parser_test_case cases[] = {
+        {"2+3*4", 0, 14},
+        {"2*3+4", 0, 10},
+        {"10-4-3", 0, 3}, // left associative
+        {"64/8/2", 0, 4},
+        {"2*(3+4)", 0, 14},
+        {"(1+2)*(3+4)", 0, 21},
+        {"((2))", 0, 2},
+        {"100/7", 0, 14},
+        {"7-10", 0, -3},
+        {"-5+3", 0, -2},
+        {"-2*3", 0, -6},
+        {" 1 + 2 * 3 \n", 0, 7}, // as written by echo
+    };
+
+    parser_test_table(test, cases, ARRAY_SIZE(cases));
+}
+
+static void parser_test_postfix(struct kunit *test)
+{
+    static const int expected[] = {1, 2, 3, '*', '+'};
+    static const bool number[] = {true, true, true, false, false};
+    struct parser *p = kunit_kzalloc(test, sizeof(*p), GFP_KERNEL);
+    int *postfix = kunit_kcalloc(test, PARSER_CAPACITY, sizeof(*postfix), GFP_KERNEL);
+    int i, count;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, p);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, postfix);
+
+    count = infix_to_postfix(p, "1+2*3", postfix);
+    KUNIT_ASSERT_EQ(test, count, (int)ARRAY_SIZE(expected));
+    for (i = 0; i < count; i++)
+    {
+        KUNIT_EXPECT_EQ(test, postfix[i], expected[i]);
+        KUNIT_EXPECT_EQ(test, p->number[i], number[i]);
+    }
+}
+
+static void parser_test_overflow(struct kunit *test)
+{
+    static const struct parser_test_case cases[] = {
+        {"2147483647", 0, INT_MAX},
+        {"-2147483647-1", 0, INT_MIN},
+        {"2147483648", -ERANGE, 0},
+        {"99999999999999999999", -ERANGE, 0},
+        {"2147483647+1", -ERANGE, 0},
+        {"-2147483647-2", -ERANGE, 0},
+        {"65536*65536", -ERANGE, 0},
+        {"(0-2147483647-1)/(0-1)", -ERANGE, 0},
+    };
+    char *expr = kunit_kzalloc(test, 2 * PARSER_CAPACITY + 2, GFP_KERNEL);
+    int res, i;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, expr);
+    parser_test_table(test, cases, ARRAY_SIZE(cases));
+
+    // n ones make 2n - 1 postfix entries, one entry is kept for the terminator
+    for (i = 0; i < PARSER_CAPACITY / 2; i++)
+    {
+        strcat(expr, i ? "+1" : "1");
+    }
+    KUNIT_EXPECT_EQ(test, parser_test_eval(test, expr, &res), 0);
+    KUNIT_EXPECT_EQ(test, res, PARSER_CAPACITY / 2);
+    strcat(expr, "+1");
+    KUNIT_EXPECT_EQ(test, parser_test_eval(test, expr, &res), -E2BIG);
+
+    // the operator stack is bounded too
+    memset(expr, '(', PARSER_CAPACITY + 1);
+    expr[PARSER_CAPACITY + 1] = '\0';
+    KUNIT_EXPECT_EQ(test, parser_test_eval(test, expr, &res), -E2BIG);
+}
+
+static void parser_test_malformed(struct kunit *test)
+{
+    static const struct parser_test_case cases[] = {
+        {"", -EINVAL, 0},
+        {"\n", -EINVAL, 0},
+        {"()", -EINVAL, 0},
+        {"1+", -EINVAL, 0},
+        {"+1", -EINVAL, 0},
+        {"-", -EINVAL, 0},
+        {"1++2", -EINVAL, 0},
+        {"1 2", -EINVAL, 0},
+        {"(1+2", -EINVAL, 0},
+        {"1+2)", -EINVAL, 0},
+        {")", -EINVAL, 0},
+        {"x", -EINVAL, 0},
+        {"1+x", -EINVAL, 0},
+        {"2^3", -EINVAL, 0},
+        {"1/0", -EDOM, 0},
+        {"1/(2-2)", -EDOM, 0},
+    };
+
+    parser_test_table(test, cases, ARRAY_SIZE(cases));
+}
+
+static struct kunit_case parser_test_cases[] = {
+    KUNIT_CASE(parser_test_precedence),
+    KUNIT_CASE(parser_test_postfix),
+    KUNIT_CASE(parser_test_overflow),
+    KUNIT_CASE(parser_test_malformed),
+    {}};
+
+static struct kunit_suite parser_test_suite = {
+    .name = "lab1_parser",
+    .test_cases = parser_test_cases,
+};
+
+/*
+ * Microbenchmarks: report ns/op as a diagnostic line, they only fail if
+ * the expression does.
+ */
+
+#define PARSER_BENCH_ITERS 100000
+
+static void parser_bench_expr(struct kunit *test, const char *expr)
+{
+    struct parser *p = kunit_kzalloc(test, sizeof(*p), GFP_KERNEL);
+    int *postfix = kunit_kcalloc(test, PARSER_CAPACITY, sizeof(*postfix), GFP_KERNEL);
+    u64 start, parse_ns = 0, eval_ns = 0;
+    int i, count = 0, res, err = 0;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, p);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, postfix);
+
+    for (i = 0; i < PARSER_BENCH_ITERS && err == 0; i++)
+    {
+        start = ktime_get_ns();
+        count = infix_to_postfix(p, expr, postfix);
+        parse_ns += ktime_get_ns() - start;
+
+        start = ktime_get_ns();
+        err = count < 0 ? count : postfix_to_eval(p, postfix, count, &res);
+        eval_ns += ktime_get_ns() - start;
+    }
+    KUNIT_ASSERT_EQ(test, err, 0);
+
+    kunit_info(test, "\"%s\": %d tokens, infix_to_postfix %llu ns/op, postfix_to_eval %llu ns/op\n", expr,
+               count, div_u64(parse_ns, PARSER_BENCH_ITERS), div_u64(eval_ns, PARSER_BENCH_ITERS));
+}
+
+static void parser_bench_short(struct kunit *test)
+{
+    parser_bench_expr(test, "2+3*4");
+}
+
+static void parser_bench_long(struct kunit *test)
+{
+    parser_bench_expr(test, "(12+34)*5-678/9+(1+2)*(3+4)*(5+6)-((7-8)*9+10)/11+12345*6-7");
+}
+
+static struct kunit_case parser_bench_cases[] = {
+    KUNIT_CASE(parser_bench_short),
+    KUNIT_CASE(parser_bench_long),
+    {}};
+
+static struct kunit_suite parser_bench_suite = {
+    .name = "lab1_parser_bench",
+    .test_cases = parser_bench_cases,
+};
+
+kunit_test_suites(&parser_test_suite, &parser_bench_suite);
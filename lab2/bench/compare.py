@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Collects lab2 fio results from a QEMU console log and compares runs.
+
+    compare.py collect <console.log> <results.json>
+    compare.py compare <baseline.json> <results.json> [threshold-percent]
+
+`compare` exits with status 1 if any job lost more than threshold percent
+of bandwidth or IOPS, or if its p99 completion latency grew by more than
+threshold percent.
+"""
+
+import json
+import sys
+
+
+def sections(lines):
+    """Yields (marker, name, body) for every @@<MARKER> ... @@END block."""
+    marker = None
+    body = []
+    for line in lines:
+        line = line.rstrip("\r\n")
+        if line.startswith("@@END") and marker:
+            yield marker[0], marker[1], body
+            marker, body = None, []
+        elif line.startswith("@@"):
+            parts = line[2:].split(maxsplit=1)
+            marker = (parts[0], parts[1] if len(parts) > 1 else "")
+            body = []
+        elif marker:
+            body.append(line)
+
+
+def job_result(name, text):
+    doc = json.loads(text[text.index("{"):])
+    job = doc["jobs"][0]
+    side = job["write"] if "write" in name.split("-")[1] else job["read"]
+    pct = side.get("clat_ns", {}).get("percentile", {})
+    return {
+        "bw_kib": side["bw"],
+        "iops": round(side["iops"], 1),
+        "lat_p50_ns": pct.get("50.000000", 0),
+        "lat_p99_ns": pct.get("99.000000", 0),
+        "runtime_ms": job.get("job_runtime", 0),
+    }
+
+
+def collect(log, out):
+    with open(log, errors="replace") as f:
+        lines = f.readlines()
+
+    results = {"jobs": {}, "numa": {}}
+    for marker, name, body in sections(lines):
+        if marker == "FAIL":
+            sys.exit("guest failed: " + name)
+        if marker == "JOB":
+            results["jobs"][name] = job_result(name, "\n".join(body))
+        elif marker == "NUMA":
+            for line in body:
+                node, rd, wr = line.split()
+                results["numa"][node] = {"read_bytes": int(rd), "write_bytes": int(wr)}
+
+    # node_bytes is cumulative over the whole matrix
+    seconds = sum(j["runtime_ms"] for j in results["jobs"].values()) / 1000
+    for node in results["numa"].values():
+        total = node["read_bytes"] + node["write_bytes"]
+        node["mib_per_s"] = round(total / seconds / 2**20, 1) if seconds else 0
+
+    with open(out, "w") as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+        f.write("\n")
+
+
+def compare(base_path, new_path, threshold):
+    with open(base_path) as f:
+        base = json.load(f)["jobs"]
+    with open(new_path) as f:
+        new = json.load(f)["jobs"]
+
+    limit = threshold / 100
+    regressions = 0
+    for name in sorted(base):
+        if name not in new:
+            print(f"{name}: missing")
+            regressions += 1
+            continue
+        b, n = base[name], new[name]
+        notes = []
+        for key in ("bw_kib", "iops"):
+            if b[key] and n[key] < b[key] * (1 - limit):
+                notes.append(f"{key} {b[key]} -> {n[key]}")
+        if b["lat_p99_ns"] and n["lat_p99_ns"] > b["lat_p99_ns"] * (1 + limit):
+            notes.append(f"lat_p99_ns {b['lat_p99_ns']} -> {n['lat_p99_ns']}")
+        if notes:
+            regressions += 1
+            print(f"{name}: " + ", ".join(notes))
+
+    print(f"{regressions} regressions in {len(base)} jobs (threshold {threshold}%)")
+    return 1 if regressions else 0
+
+
+def main():
+    if len(sys.argv) >= 4 and sys.argv[1] == "collect":
+        collect(sys.argv[2], sys.argv[3])
+        return 0
+    if len(sys.argv) >= 4 and sys.argv[1] == "compare":
+        threshold = float(sys.argv[4]) if len(sys.argv) > 4 else 10
+        return compare(sys.argv[2], sys.argv[3], threshold)
+    sys.exit(__doc__)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Runs inside the benchmark guest. Every fio result is printed to the
+# console between "@@JOB <name>" and "@@END" markers so that
+# compare.py can pick it out of the console log.
+
+: "${RUNTIME:=5}"
+: "${MODULE_ARGS:=}"
+: "${PATTERNS:=read write randread randwrite}"
+: "${BLOCK_SIZES:=4k 64k 1m}"
+: "${DEPTHS:=1 32 128}"
+: "${JOBS:=1 $(nproc)}"
+
+# shellcheck disable=SC2086
+insmod /lab2.ko $MODULE_ARGS || { echo "@@FAIL insmod"; exit 1; }
+
+mkfs.vfat /dev/lab2p1 > /dev/null
+mount /dev/lab2p1 /mnt
+
+run_matrix() {
+    target=$1
+    shift
+    for rw in $PATTERNS; do
+        for bs in $BLOCK_SIZES; do
+            for qd in $DEPTHS; do
+                for nj in $JOBS; do
+                    name="$target-$rw-$bs-qd$qd-j$nj"
+                    echo "@@JOB $name"
+                    fio --name="$name" --rw="$rw" --bs="$bs" --iodepth="$qd" \
+                        --numjobs="$nj" --group_reporting --ioengine=libaio \
+                        --direct=1 --time_based --runtime="$RUNTIME" \
+                        --randrepeat=1 --output-format=json "$@"
+                    echo "@@END"
+                done
+            done
+        done
+    done
+}
+
+# p2 is never mounted, so raw writes leave the MBR and the vfat on p1 intact
+run_matrix raw --filename=/dev/lab2p2
+run_matrix fs --filename=/mnt/fio.dat --size=8M
+
+umount /mnt
+
+echo "@@NUMA"
+cat /sys/block/lab2/numa/node_bytes
+echo "@@END"
+
+echo "@@STATS"
+cat /sys/kernel/debug/lab2/stats
+echo "@@END"
+
+rmmod lab2
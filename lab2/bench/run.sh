@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Boots a minimal kernel in QEMU with lab2.ko, runs the fio matrix from
+# guest.sh and compares the results with the stored baseline.
+#
+# Required:
+#   KERNEL   - bzImage of the kernel lab2.ko was built against (KDIR)
+#   BUSYBOX  - static busybox binary
+#   FIO      - static fio binary
+# Optional:
+#   CPUS=4 MEM=1G RUNTIME=5       - guest size and seconds per fio job
+#   QEMU_ARGS="-numa node ..."    - extra QEMU options, e.g. a NUMA topology
+#   MODULE_ARGS="numa_policy=..." - insmod parameters
+#   RESULTS=bench/results.json BASELINE=bench/baseline.json
+#   THRESHOLD=10                  - allowed regression, percent
+#
+# Run with --save-baseline to store the results as the new baseline.
+
+set -eu
+
+cd "$(dirname "$0")/.."
+
+: "${KERNEL:?set KERNEL to a bzImage}"
+: "${BUSYBOX:=$(command -v busybox || true)}"
+: "${FIO:=$(command -v fio || true)}"
+: "${CPUS:=4}"
+: "${MEM:=1G}"
+: "${RUNTIME:=5}"
+: "${QEMU_ARGS:=}"
+: "${MODULE_ARGS:=}"
+: "${RESULTS:=bench/results.json}"
+: "${BASELINE:=bench/baseline.json}"
+: "${THRESHOLD:=10}"
+
+[ -x "$BUSYBOX" ] || { echo "set BUSYBOX to a static busybox" >&2; exit 1; }
+[ -x "$FIO" ] || { echo "set FIO to a static fio" >&2; exit 1; }
+[ -f lab2.ko ] || { echo "build lab2.ko first (make KDIR=...)" >&2; exit 1; }
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# initramfs: busybox, fio, the module and the guest script
+root="$work/root"
+mkdir -p "$root/bin" "$root/proc" "$root/sys" "$root/dev" "$root/mnt" "$root/tmp"
+cp "$BUSYBOX" "$root/bin/busybox"
+cp "$FIO" "$root/bin/fio"
+cp lab2.ko bench/guest.sh "$root/"
+for app in sh mount umount insmod rmmod mkfs.vfat cat echo nproc poweroff sleep; do
+    ln -s busybox "$root/bin/$app"
+done
+cat > "$root/init" <<EOF
+#!/bin/sh
+export PATH=/bin
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t devtmpfs devtmpfs /dev
+mount -t debugfs debugfs /sys/kernel/debug
+RUNTIME=$RUNTIME MODULE_ARGS="$MODULE_ARGS" sh /guest.sh
+poweroff -f
+EOF
+chmod +x "$root/init"
+(cd "$root" && find . | cpio -o -H newc --quiet | gzip) > "$work/initrd.gz"
+
+# shellcheck disable=SC2086
+qemu-system-x86_64 -enable-kvm -cpu host -smp "$CPUS" -m "$MEM" \
+    -kernel "$KERNEL" -initrd "$work/initrd.gz" \
+    -append "console=ttyS0 quiet loglevel=0 panic=-1" \
+    -nographic -no-reboot $QEMU_ARGS > "$work/console.log"
+
+python3 bench/compare.py collect "$work/console.log" "$RESULTS"
+echo "results written to $RESULTS"
+
+if [ "${1:-}" = "--save-baseline" ]; then
+    cp "$RESULTS" "$BASELINE"
+    echo "baseline updated"
+elif [ -f "$BASELINE" ]; then
+    python3 bench/compare.py compare "$BASELINE" "$RESULTS" "$THRESHOLD"
+else
+    echo "no baseline at $BASELINE, run with --save-baseline to create one"
+fi
@@ -1,12 +1,30 @@
 #include <linux/blk-mq.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h>
-#include <linux/genhd.h>
 #include <linux/init.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+#include <linux/genhd.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "lab2_trace.h"
 
 //------------------------------------------------------------------------
 
@@ -46,6 +64,8 @@
 
 #define MEMSIZE (PART1_SIZE + PART2_SIZE + PART3_SIZE + 3) // Size of Ram disk in sectors
 
+#define DEV_NAME "lab2"
+
 //------------------------------------------------------------------------
 
 /*
@@ -178,13 +198,12 @@ static void copy_mbr(u8 *disk)
     *(unsigned short *)(disk + MBR_SIGNATURE_OFFSET) = MBR_SIGNATURE;
 }
 
-static void copy_br(u8 *disk, int abs_start_sector, const PartTable *part_table)
+static void copy_br(u8 *br, const PartTable *part_table)
 {
-    disk += (abs_start_sector * SECTOR_SIZE);
-    memset(disk, 0x0, BR_SIZE);
-    memcpy(disk + PARTITION_TABLE_OFFSET, part_table,
+    memset(br, 0x0, BR_SIZE);
+    memcpy(br + PARTITION_TABLE_OFFSET, part_table,
            PARTITION_TABLE_SIZE);
-    *(unsigned short *)(disk + BR_SIGNATURE_OFFSET) = BR_SIGNATURE;
+    *(unsigned short *)(br + BR_SIGNATURE_OFFSET) = BR_SIGNATURE;
 }
 
 static void copy_mbr_n_br(u8 *disk)
@@ -193,196 +212,1587 @@ static void copy_mbr_n_br(u8 *disk)
     copy_mbr(disk);
     for (i = 0; i < ARRAY_SIZE(def_log_part_table); i++)
     {
-        copy_br(disk, def_log_part_br_abs_start_sector[i], &def_log_part_table[i]);
+        copy_br(disk + def_log_part_br_abs_start_sector[i] * SECTOR_SIZE, &def_log_part_table[i]);
     }
 }
 
 //------------------------------------------------------------------------
 
 /*
-	Block device functions and structures
+	NUMA placement of the disk pages
+
+	local      - all pages on the node that loaded the module
+	interleave - page i goes to online node i % nr_nodes
+	stripe     - stripe_kb chunks go round-robin over the nodes and every
+	             node gets a hardware queue served by its own CPUs
 */
 
-#define DEV_NAME "lab2"
+static char *numa_policy = "local";
+module_param(numa_policy, charp, 0);
+MODULE_PARM_DESC(numa_policy, "page placement: local, interleave or stripe");
 
-static int major = 0;
+static unsigned int stripe_kb = 1024;
+module_param(stripe_kb, uint, 0);
+MODULE_PARM_DESC(stripe_kb, "stripe chunk size in KiB for numa_policy=stripe");
 
-static struct ram_device
+enum rb_numa_policy
 {
-	unsigned int size;
-	u8 * data;
-	struct blk_mq_tag_set tag_set;
-	struct request_queue *queue;
-	struct gendisk *gd;
-} device;
+	RB_NUMA_LOCAL,
+	RB_NUMA_INTERLEAVE,
+	RB_NUMA_STRIPE,
+};
 
-static int bdev_open(struct block_device *bdev, fmode_t mode)
+static const char *const rb_numa_names[] = {
+	[RB_NUMA_LOCAL] = "local",
+	[RB_NUMA_INTERLEAVE] = "interleave",
+	[RB_NUMA_STRIPE] = "stripe",
+};
+
+static struct rb_numa
+{
+	enum rb_numa_policy policy;
+	int nodes[MAX_NUMNODES]; // online node ids, compacted
+	int nr_nodes;
+	unsigned int stripe_pages;
+	u64 __percpu *bytes; // [node * 2 + dir], bytes copied to/from each node
+} numa;
+
+static int rb_numa_init(void)
+{
+	int i, node;
+
+	i = match_string(rb_numa_names, ARRAY_SIZE(rb_numa_names), numa_policy);
+	if (i < 0)
+	{
+		printk(KERN_ERR DEV_NAME " : unknown numa_policy %s\n", numa_policy);
+		return -EINVAL;
+	}
+	numa.policy = i;
+
+	numa.nr_nodes = 0;
+	for_each_online_node(node)
+	{
+		numa.nodes[numa.nr_nodes++] = node;
+	}
+	numa.stripe_pages = max_t(unsigned int, stripe_kb * 1024 / PAGE_SIZE, 1);
+
+	numa.bytes = __alloc_percpu(nr_node_ids * 2 * sizeof(u64), sizeof(u64));
+	return numa.bytes ? 0 : -ENOMEM;
+}
+
+static void rb_numa_cleanup(void)
+{
+	free_percpu(numa.bytes);
+}
+
+static int rb_page_node(pgoff_t idx)
+{
+	switch (numa.policy)
+	{
+	case RB_NUMA_INTERLEAVE:
+		return numa.nodes[idx % numa.nr_nodes];
+	case RB_NUMA_STRIPE:
+		return numa.nodes[(idx / numa.stripe_pages) % numa.nr_nodes];
+	default:
+		return NUMA_NO_NODE;
+	}
+}
+
+static inline void rb_numa_account(int node, int dir, unsigned int bytes)
+{
+	this_cpu_add(numa.bytes[node * 2 + (dir == WRITE)], bytes);
+}
+
+static unsigned int rb_nr_hw_queues(void)
+{
+	return numa.policy == RB_NUMA_STRIPE ? numa.nr_nodes : 1;
+}
+
+/* In stripe mode every CPU submits to the queue of its own node */
+static void rb_map_node_queues(struct blk_mq_tag_set *set)
+{
+	struct blk_mq_queue_map *map = &set->map[HCTX_TYPE_DEFAULT];
+	unsigned int cpu;
+	int i;
+
+	for_each_possible_cpu(cpu)
+	{
+		map->mq_map[cpu] = 0;
+		for (i = 0; i < numa.nr_nodes; i++)
+		{
+			if (numa.nodes[i] == cpu_to_node(cpu))
+			{
+				map->mq_map[cpu] = map->queue_offset + i;
+			}
+		}
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static void rb_map_queues(struct blk_mq_tag_set *set)
+{
+	if (numa.policy == RB_NUMA_STRIPE)
+		rb_map_node_queues(set);
+	else
+		blk_mq_map_queues(&set->map[HCTX_TYPE_DEFAULT]);
+}
+#else
+static int rb_map_queues(struct blk_mq_tag_set *set)
 {
-	printk(DEV_NAME " : open \n");
+	if (numa.policy != RB_NUMA_STRIPE)
+		return blk_mq_map_queues(&set->map[HCTX_TYPE_DEFAULT]);
+	rb_map_node_queues(set);
 	return 0;
 }
+#endif
 
-static void bdev_release(struct gendisk *gd, fmode_t mode)
+//------------------------------------------------------------------------
+
+/*
+	Write-back cache over a backing file
+
+	When `backing` is set the disk keeps only a sparse set of pages in
+	memory (an xarray indexed by page number) and the file or block
+	device is the persistent tier. Writes dirty cached pages, a delayed
+	work flushes them in contiguous batches, and a shrinker drops clean
+	pages under memory pressure.
+*/
+
+static char *backing = NULL;
+module_param(backing, charp, 0);
+MODULE_PARM_DESC(backing, "file or block device used as persistent tier (enables cache mode)");
+
+static unsigned int writeback_ms = 1000;
+module_param(writeback_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_ms, "background writeback period in ms");
+
+static unsigned int dirty_thresh = 4096;
+module_param(dirty_thresh, uint, 0644);
+MODULE_PARM_DESC(dirty_thresh, "dirty pages that kick writeback early");
+
+#define RB_DIRTY XA_MARK_0
+#define RB_WB_BATCH 256 // max pages in one backing write
+#define RB_SECT_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+
+static struct rb_cache
+{
+	struct file *file;
+	struct xarray pages;
+	struct mutex wb_lock; // serializes writeback passes
+	struct delayed_work wb_work;
+	struct shrinker *shrinker;
+	pgoff_t evict_cursor;
+
+	atomic_long_t nr_pages;
+	atomic_long_t nr_dirty;
+	atomic64_t hits;
+	atomic64_t misses;
+	atomic64_t evictions;
+	atomic64_t wb_pages;
+	atomic64_t wb_bytes;
+	atomic64_t wb_ns;
+	atomic64_t wb_errors;
+
+	// writeback batch, protected by wb_lock
+	struct page *wb_batch[RB_WB_BATCH];
+	struct bio_vec wb_vec[RB_WB_BATCH];
+} cache;
+
+static inline bool rb_cache_mode(void)
 {
-	printk(DEV_NAME " : closed \n");
+	return cache.file != NULL;
 }
 
-static struct block_device_operations fops =
+/* Returns the cached page with an extra reference or NULL */
+static struct page *rb_cache_lookup(pgoff_t idx)
+{
+	struct page *page;
+
+	rcu_read_lock();
+repeat:
+	page = xa_load(&cache.pages, idx);
+	if (page)
 	{
-		.owner = THIS_MODULE,
-		.open = bdev_open,
-		.release = bdev_release,
-};
+		if (!get_page_unless_zero(page))
+			goto repeat;
+		// the page may have been evicted and reused in between
+		if (unlikely(page != xa_load(&cache.pages, idx)))
+		{
+			put_page(page);
+			goto repeat;
+		}
+	}
+	rcu_read_unlock();
+	return page;
+}
 
-static int rb_transfer(struct request *req, unsigned int *nr_bytes)
+static int rb_cache_fill(struct page *page, pgoff_t idx)
 {
-	int dir = rq_data_dir(req);
-	int ret = 0;
-	sector_t start_sector = blk_rq_pos(req);
-	unsigned int sector_cnt = blk_rq_sectors(req);
-	struct bio_vec bv;
-#define BV_PAGE(bv) ((bv).bv_page)
-#define BV_OFFSET(bv) ((bv).bv_offset)
-#define BV_LEN(bv) ((bv).bv_len)
-	struct req_iterator iter;
-	sector_t sector_offset;
-	unsigned int sectors;
-	u8 *buffer;
-	sector_offset = 0;
-	rq_for_each_segment(bv, req, iter)
+	loff_t pos = (loff_t)idx << PAGE_SHIFT;
+	ssize_t ret = kernel_read(cache.file, page_address(page), PAGE_SIZE, &pos);
+
+	// short read past the end of the backing file leaves zeroes
+	return ret < 0 ? ret : 0;
+}
+
+/*
+	Returns the page for idx with an extra reference, reading it from
+	the backing file on a miss unless the caller overwrites all of it.
+*/
+static struct page *rb_cache_get(pgoff_t idx, bool overwrite)
+{
+	struct page *page, *old;
+	int err;
+
+	page = rb_cache_lookup(idx);
+	if (page)
 	{
-		buffer = page_address(BV_PAGE(bv)) + BV_OFFSET(bv);
-		if (BV_LEN(bv) % (SECTOR_SIZE) != 0)
+		atomic64_inc(&cache.hits);
+		return page;
+	}
+	atomic64_inc(&cache.misses);
+
+	for (;;)
+	{
+		page = alloc_pages_node(rb_page_node(idx), GFP_NOIO | __GFP_ZERO, 0);
+		if (!page)
+			return ERR_PTR(-ENOMEM);
+
+		if (!overwrite && (err = rb_cache_fill(page, idx)) != 0)
 		{
-			printk(KERN_ERR "bio size is not a multiple ofsector size\n");
-			ret = -EIO;
+			put_page(page);
+			return ERR_PTR(err);
 		}
-		sectors = BV_LEN(bv) / SECTOR_SIZE;
+
+		// the first reference belongs to the xarray, the second to the caller
+		get_page(page);
+		old = xa_cmpxchg(&cache.pages, idx, NULL, page, GFP_NOIO);
+		if (!old)
+		{
+			atomic_long_inc(&cache.nr_pages);
+			return page;
+		}
+
+		put_page(page);
+		put_page(page);
+		if (xa_is_err(old))
+			return ERR_PTR(xa_err(old));
+
+		// lost the race with another filler
+		page = rb_cache_lookup(idx);
+		if (page)
+			return page;
+	}
+}
+
+static void rb_cache_set_dirty(pgoff_t idx)
+{
+	xa_lock(&cache.pages);
+	if (!xa_get_mark(&cache.pages, idx, RB_DIRTY))
+	{
+		__xa_set_mark(&cache.pages, idx, RB_DIRTY);
+		atomic_long_inc(&cache.nr_dirty);
+	}
+	xa_unlock(&cache.pages);
+}
+
+static int rb_cache_copy(sector_t sector, u8 *buffer, unsigned int len, int dir)
+{
+	while (len)
+	{
+		pgoff_t idx = sector / RB_SECT_PER_PAGE;
+		unsigned int off = (sector % RB_SECT_PER_PAGE) * SECTOR_SIZE;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - off);
+		struct page *page = rb_cache_get(idx, dir == WRITE && n == PAGE_SIZE);
+
+		if (IS_ERR(page))
+			return PTR_ERR(page);
 
 		if (dir == WRITE)
 		{
-			memcpy((device.data) + ((start_sector + sector_offset) * SECTOR_SIZE), buffer, sectors * SECTOR_SIZE);
+			memcpy(page_address(page) + off, buffer, n);
+			rb_cache_set_dirty(idx);
 		}
 		else
 		{
-			memcpy(buffer, (device.data) + ((start_sector + sector_offset) * SECTOR_SIZE), sectors * SECTOR_SIZE);
+			memcpy(buffer, page_address(page) + off, n);
 		}
-		sector_offset += sectors;
-		*nr_bytes += BV_LEN(bv);
+		rb_numa_account(page_to_nid(page), dir, n);
+		put_page(page);
+
+		buffer += n;
+		sector += n / SECTOR_SIZE;
+		len -= n;
 	}
 
-	if (sector_offset != sector_cnt)
+	if (atomic_long_read(&cache.nr_dirty) > dirty_thresh)
+		mod_delayed_work(system_wq, &cache.wb_work, 0);
+	return 0;
+}
+
+/*
+	Grabs up to RB_WB_BATCH contiguous dirty pages starting at *next and
+	clears their dirty mark. Writers that race with the flush re-dirty
+	the page, so nothing is lost.
+*/
+static unsigned int rb_cache_collect(pgoff_t *next, pgoff_t last, pgoff_t *start)
+{
+	XA_STATE(xas, &cache.pages, *next);
+	struct page *page;
+	unsigned int n = 0;
+
+	xas_lock(&xas);
+	xas_for_each_marked(&xas, page, last, RB_DIRTY)
 	{
-		printk("mydisk: bio info doesn't match with the request info");
-		ret = -EIO;
+		if (n == 0)
+			*start = xas.xa_index;
+		else if (xas.xa_index != *start + n)
+			break;
+
+		get_page(page);
+		xas_clear_mark(&xas, RB_DIRTY);
+		cache.wb_batch[n++] = page;
+		if (n == RB_WB_BATCH)
+			break;
 	}
-	return ret;
+	xas_unlock(&xas);
+
+	atomic_long_sub(n, &cache.nr_dirty);
+	if (n)
+		*next = *start + n;
+	return n;
 }
 
-static blk_status_t queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data* bd)
+static int rb_cache_writeback(pgoff_t first, pgoff_t last)
 {
-    unsigned int nr_bytes = 0;
-    blk_status_t status = BLK_STS_OK;
-    struct request *rq = bd->rq;
+	pgoff_t next = first, start = 0;
+	unsigned int i, n;
+	int err = 0;
 
-    /* Start request serving procedure */
-    blk_mq_start_request(rq);
+	mutex_lock(&cache.wb_lock);
+	while ((n = rb_cache_collect(&next, last, &start)) != 0)
+	{
+		struct iov_iter iter;
+		loff_t pos = (loff_t)start << PAGE_SHIFT;
+		size_t len = (size_t)n << PAGE_SHIFT;
+		u64 t0 = ktime_get_ns();
+		ssize_t ret;
 
-    if (rb_transfer(rq, &nr_bytes) != 0) {
-        status = BLK_STS_IOERR;
-    }
+		for (i = 0; i < n; i++)
+		{
+			cache.wb_vec[i].bv_page = cache.wb_batch[i];
+			cache.wb_vec[i].bv_offset = 0;
+			cache.wb_vec[i].bv_len = PAGE_SIZE;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+		iov_iter_bvec(&iter, ITER_SOURCE, cache.wb_vec, n, len);
+#else
+		iov_iter_bvec(&iter, WRITE, cache.wb_vec, n, len);
+#endif
+		ret = vfs_iter_write(cache.file, &iter, &pos, 0);
 
-    /* Notify kernel about processed nr_bytes */
-    if (blk_update_request(rq, status, nr_bytes)) {
-        /* Shouldn't fail */
-        BUG();
-    }
+		if (ret == len)
+		{
+			atomic64_add(n, &cache.wb_pages);
+			atomic64_add(len, &cache.wb_bytes);
+			atomic64_add(ktime_get_ns() - t0, &cache.wb_ns);
+		}
+		else
+		{
+			atomic64_inc(&cache.wb_errors);
+			err = ret < 0 ? ret : -EIO;
+			for (i = 0; i < n; i++)
+				rb_cache_set_dirty(start + i);
+		}
+
+		for (i = 0; i < n; i++)
+			put_page(cache.wb_batch[i]);
+		if (err)
+			break;
+	}
+	mutex_unlock(&cache.wb_lock);
+	return err;
+}
 
-    /* Stop request serving procedure */
-    __blk_mq_end_request(rq, status);
+static int rb_cache_flush(void)
+{
+	int err = rb_cache_writeback(0, ULONG_MAX);
 
-    return status;
+	return err ? err : vfs_fsync(cache.file, 0);
 }
 
-static struct blk_mq_ops mq_ops = {
-    .queue_rq = queue_rq,
-};
+static int rb_cache_flush_range(sector_t sector, unsigned int sectors)
+{
+	loff_t pos = (loff_t)sector * SECTOR_SIZE;
+	loff_t end = pos + (loff_t)sectors * SECTOR_SIZE - 1;
+	int err = rb_cache_writeback(pos >> PAGE_SHIFT, end >> PAGE_SHIFT);
 
-//------------------------------------------------------------------------
+	return err ? err : vfs_fsync_range(cache.file, pos, end, 1);
+}
 
-static int ramdisk_init(void)
+static void rb_cache_wb_fn(struct work_struct *work)
 {
-	(device.data) = vmalloc(MEMSIZE * SECTOR_SIZE);
-	copy_mbr_n_br(device.data);
-	return MEMSIZE;
+	rb_cache_writeback(0, ULONG_MAX);
+	if (writeback_ms)
+		mod_delayed_work(system_wq, &cache.wb_work, msecs_to_jiffies(writeback_ms));
 }
 
-static void ramdisk_cleanup(void)
+static unsigned long rb_cache_count(struct shrinker *s, struct shrink_control *sc)
 {
-	vfree(device.data);
+	long clean = atomic_long_read(&cache.nr_pages) - atomic_long_read(&cache.nr_dirty);
+
+	return clean > 0 ? clean : SHRINK_EMPTY;
 }
 
-static int __init lab2_init(void)
+static unsigned long rb_cache_scan(struct shrinker *s, struct shrink_control *sc)
 {
-	device.size = ramdisk_init();
-	printk(KERN_INFO "THIS IS DEVICE SIZE %d", device.size);
+	XA_STATE(xas, &cache.pages, cache.evict_cursor);
+	unsigned long freed = 0;
+	struct page *page;
 
-	if ((major = register_blkdev(0, DEV_NAME)) < 0)
+	xas_lock(&xas);
+	xas_for_each(&xas, page, ULONG_MAX)
 	{
-		printk("Failed to register block_dev\n");
-		ramdisk_cleanup();
-		return -ENOMEM;
+		if (freed >= sc->nr_to_scan)
+			break;
+		if (xas_get_mark(&xas, RB_DIRTY))
+			continue;
+		// fails if a request or writeback currently holds the page
+		if (!page_ref_freeze(page, 1))
+			continue;
+
+		xas_store(&xas, NULL);
+		page_ref_unfreeze(page, 1);
+		put_page(page);
+		freed++;
 	}
+	cache.evict_cursor = freed >= sc->nr_to_scan ? xas.xa_index : 0;
+	xas_unlock(&xas);
 
-	printk("Major Number is : %d", major);
-	if (!(device.queue = blk_mq_init_sq_queue(&device.tag_set, &mq_ops, 128, BLK_MQ_F_SHOULD_MERGE)))
-	{
-		printk("Failed init queue\n");
-		unregister_blkdev(major, DEV_NAME);
-		ramdisk_cleanup();
+	atomic_long_sub(freed, &cache.nr_pages);
+	atomic64_add(freed, &cache.evictions);
+	return freed ? freed : SHRINK_STOP;
+}
+
+static int rb_cache_format(void)
+{
+	u8 *sector = kmalloc(SECTOR_SIZE, GFP_KERNEL);
+	loff_t pos;
+	ssize_t ret;
+	int i;
+
+	if (!sector)
 		return -ENOMEM;
+
+	copy_mbr(sector);
+	pos = 0;
+	ret = kernel_write(cache.file, sector, SECTOR_SIZE, &pos);
+	for (i = 0; ret == SECTOR_SIZE && i < ARRAY_SIZE(def_log_part_table); i++)
+	{
+		copy_br(sector, &def_log_part_table[i]);
+		pos = (loff_t)def_log_part_br_abs_start_sector[i] * SECTOR_SIZE;
+		ret = kernel_write(cache.file, sector, SECTOR_SIZE, &pos);
 	}
+	kfree(sector);
+	return ret == SECTOR_SIZE ? 0 : -EIO;
+}
 
-    device.queue->queuedata = &device;
+static int rb_cache_init(void)
+{
+	struct inode *inode;
+	int err;
 
-    if (!(device.gd = alloc_disk(8))) {
-		printk(KERN_INFO "Failed alloc disk\n");
-		blk_cleanup_queue(device.queue);
-		unregister_blkdev(major, DEV_NAME);
-		ramdisk_cleanup();
-		return -ENOMEM;
+	cache.file = filp_open(backing, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(cache.file))
+	{
+		err = PTR_ERR(cache.file);
+		cache.file = NULL;
+		return err;
 	}
 
-    device.gd->major = major;
-    device.gd->first_minor = 0;
-	device.gd->fops = &fops;
-	device.gd->queue = device.queue;
-	device.gd->private_data = &device;
+	// block devices keep their size on the bdev inode
+	inode = cache.file->f_mapping->host;
+	if (S_ISREG(inode->i_mode) && i_size_read(inode) == 0)
+	{
+		// fresh file, give it the same partition layout as the RAM disk
+		if ((err = rb_cache_format()) != 0)
+			goto out_close;
+	}
+	else if (i_size_read(inode) < (loff_t)MEMSIZE * SECTOR_SIZE)
+	{
+		// a short image is somebody's data, never format over it
+		printk(KERN_ERR DEV_NAME " : %s is smaller than the disk\n", backing);
+		err = -ENOSPC;
+		goto out_close;
+	}
 
-    sprintf(((device.gd)->disk_name), DEV_NAME);
-	set_capacity(device.gd, device.size);
-	add_disk(device.gd);
+	xa_init(&cache.pages);
+	mutex_init(&cache.wb_lock);
+	INIT_DELAYED_WORK(&cache.wb_work, rb_cache_wb_fn);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	cache.shrinker = shrinker_alloc(0, DEV_NAME "-cache");
+	if (!cache.shrinker)
+	{
+		err = -ENOMEM;
+		goto out_close;
+	}
+	cache.shrinker->count_objects = rb_cache_count;
+	cache.shrinker->scan_objects = rb_cache_scan;
+	shrinker_register(cache.shrinker);
+#else
+	{
+		static struct shrinker shrinker = {
+			.count_objects = rb_cache_count,
+			.scan_objects = rb_cache_scan,
+			.seeks = DEFAULT_SEEKS,
+		};
+		cache.shrinker = &shrinker;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+		err = register_shrinker(cache.shrinker, DEV_NAME "-cache");
+#else
+		err = register_shrinker(cache.shrinker);
+#endif
+		if (err)
+			goto out_close;
+	}
+#endif
+
+	if (writeback_ms)
+		schedule_delayed_work(&cache.wb_work, msecs_to_jiffies(writeback_ms));
+	printk(KERN_INFO DEV_NAME " : caching %s\n", backing);
 	return 0;
+
+out_close:
+	filp_close(cache.file, NULL);
+	cache.file = NULL;
+	return err;
 }
 
-static void __exit lab2_exit(void)
+static void rb_cache_cleanup(void)
 {
-	del_gendisk(device.gd);
-	put_disk(device.gd);
-	blk_cleanup_queue(device.queue);
-	unregister_blkdev(major, DEV_NAME);
-	ramdisk_cleanup();
+	struct page *page;
+	unsigned long idx;
+
+	cancel_delayed_work_sync(&cache.wb_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	shrinker_free(cache.shrinker);
+#else
+	unregister_shrinker(cache.shrinker);
+#endif
+
+	if (rb_cache_flush())
+		printk(KERN_ERR DEV_NAME " : final writeback to %s failed\n", backing);
+
+	xa_for_each(&cache.pages, idx, page)
+		put_page(page);
+	xa_destroy(&cache.pages);
+	filp_close(cache.file, NULL);
+	cache.file = NULL;
 }
 
 //------------------------------------------------------------------------
 
-module_init(lab2_init);
-module_exit(lab2_exit);
+/*
+	Cache statistics in /sys/block/lab2/cache/
+*/
 
-MODULE_LICENSE("GPL");
-MODULE_AUTHOR("luribina");
-MODULE_DESCRIPTION("io lab2");
-MODULE_VERSION("1.0");
+static ssize_t hits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", atomic64_read(&cache.hits));
+}
+
+static ssize_t misses_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", atomic64_read(&cache.misses));
+}
+
+static ssize_t hit_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u64 hits = atomic64_read(&cache.hits);
+	u64 total = hits + atomic64_read(&cache.misses);
+	u64 permille = total ? div64_u64(hits * 1000, total) : 0;
+
+	return sprintf(buf, "%llu.%llu%%\n", permille / 10, permille % 10);
+}
+
+static ssize_t cached_pages_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n", atomic_long_read(&cache.nr_pages));
+}
+
+static ssize_t dirty_pages_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n", atomic_long_read(&cache.nr_dirty));
+}
+
+static ssize_t evictions_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", atomic64_read(&cache.evictions));
+}
+
+static ssize_t writeback_pages_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", atomic64_read(&cache.wb_pages));
+}
+
+static ssize_t writeback_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", atomic64_read(&cache.wb_bytes));
+}
+
+/* Average throughput of the backing writes, in KiB/s */
+static ssize_t writeback_kbps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u64 bytes = atomic64_read(&cache.wb_bytes);
+	u64 ns = atomic64_read(&cache.wb_ns);
+
+	return sprintf(buf, "%llu\n", ns ? div64_u64(bytes * (NSEC_PER_SEC / 1024), ns) : 0);
+}
+
+static ssize_t writeback_errors_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", atomic64_read(&cache.wb_errors));
+}
+
+static DEVICE_ATTR_RO(hits);
+static DEVICE_ATTR_RO(misses);
+static DEVICE_ATTR_RO(hit_rate);
+static DEVICE_ATTR_RO(cached_pages);
+static DEVICE_ATTR_RO(dirty_pages);
+static DEVICE_ATTR_RO(evictions);
+static DEVICE_ATTR_RO(writeback_pages);
+static DEVICE_ATTR_RO(writeback_bytes);
+static DEVICE_ATTR_RO(writeback_kbps);
+static DEVICE_ATTR_RO(writeback_errors);
+
+static struct attribute *cache_attrs[] = {
+	&dev_attr_hits.attr,
+	&dev_attr_misses.attr,
+	&dev_attr_hit_rate.attr,
+	&dev_attr_cached_pages.attr,
+	&dev_attr_dirty_pages.attr,
+	&dev_attr_evictions.attr,
+	&dev_attr_writeback_pages.attr,
+	&dev_attr_writeback_bytes.attr,
+	&dev_attr_writeback_kbps.attr,
+	&dev_attr_writeback_errors.attr,
+	NULL,
+};
+
+static umode_t cache_attrs_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	return rb_cache_mode() ? attr->mode : 0;
+}
+
+static const struct attribute_group cache_attr_group = {
+	.name = "cache",
+	.attrs = cache_attrs,
+	.is_visible = cache_attrs_visible,
+};
+
+//------------------------------------------------------------------------
+
+/*
+	NUMA statistics in /sys/block/lab2/numa/
+*/
+
+static ssize_t policy_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", rb_numa_names[numa.policy]);
+}
+
+/* One line per online node: node, bytes read, bytes written */
+static ssize_t node_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	int i, cpu;
+
+	for (i = 0; i < numa.nr_nodes; i++)
+	{
+		int node = numa.nodes[i];
+		u64 rd = 0, wr = 0;
+
+		for_each_possible_cpu(cpu)
+		{
+			rd += per_cpu_ptr(numa.bytes, cpu)[node * 2];
+			wr += per_cpu_ptr(numa.bytes, cpu)[node * 2 + 1];
+		}
+		len += scnprintf(buf + len, PAGE_SIZE - len, "node%d %llu %llu\n", node, rd, wr);
+	}
+	return len;
+}
+
+static DEVICE_ATTR_RO(policy);
+static DEVICE_ATTR_RO(node_bytes);
+
+static struct attribute *numa_attrs[] = {
+	&dev_attr_policy.attr,
+	&dev_attr_node_bytes.attr,
+	NULL,
+};
+
+static const struct attribute_group numa_attr_group = {
+	.name = "numa",
+	.attrs = numa_attrs,
+};
+
+static const struct attribute_group *disk_attr_groups[] = {
+	&cache_attr_group,
+	&numa_attr_group,
+	NULL,
+};
+
+//------------------------------------------------------------------------
+
+/*
+	Per-CPU I/O statistics in /sys/kernel/debug/lab2/
+
+	Requests are split by op and by the partition their first sector
+	falls into. Every counter is a this_cpu op, so the accounting costs a
+	handful of instructions per request and can stay enabled.
+*/
+
+enum rb_op
+{
+	RB_OP_READ,
+	RB_OP_WRITE,
+	RB_OP_FLUSH,
+	RB_NR_OPS,
+};
+
+static const char *const rb_op_names[] = {"read", "write", "flush"};
+
+enum rb_part
+{
+	RB_PART_DISK, // MBR and EBR sectors
+	RB_PART_P1,
+	RB_PART_P2,
+	RB_PART_P5,
+	RB_PART_P6,
+	RB_NR_PARTS,
+};
+
+static const char *const rb_part_names[] = {"disk", "p1", "p2", "p5", "p6"};
+
+#define RB_LAT_BUCKETS 32 // bucket b counts latencies in [2^(b-1), 2^b) ns, the last one [2^30, inf)
+
+struct rb_io_stats
+{
+	u64 reqs[RB_NR_OPS][RB_NR_PARTS];
+	u64 bytes[RB_NR_OPS][RB_NR_PARTS];
+	u64 segs[RB_NR_OPS][RB_NR_PARTS];
+	u64 errors[RB_NR_OPS];
+	u64 lat[RB_NR_OPS][RB_LAT_BUCKETS];
+};
+
+static struct rb_io_stats __percpu *io_stats;
+static struct dentry *debugfs_dir;
+
+static enum rb_part rb_part_of(sector_t sector)
+{
+	const sector_t p5 = def_log_part_br_abs_start_sector[0] + 1;
+	const sector_t p6 = def_log_part_br_abs_start_sector[1] + 1;
+
+	if (sector >= 1 && sector < 1 + PART1_SIZE)
+		return RB_PART_P1;
+	if (sector >= PART1_SIZE + 1 && sector < PART1_SIZE + 1 + PART2_SIZE)
+		return RB_PART_P2;
+	if (sector >= p5 && sector < p5 + PART31_SIZE)
+		return RB_PART_P5;
+	if (sector >= p6 && sector < p6 + PART32_SIZE)
+		return RB_PART_P6;
+	return RB_PART_DISK;
+}
+
+static void rb_account(struct request *rq, unsigned int bytes, blk_status_t status, u64 ns)
+{
+	enum rb_op op;
+	enum rb_part part;
+
+	if (req_op(rq) == REQ_OP_FLUSH)
+		op = RB_OP_FLUSH;
+	else
+		op = rq_data_dir(rq) == WRITE ? RB_OP_WRITE : RB_OP_READ;
+	part = rb_part_of(blk_rq_pos(rq));
+
+	this_cpu_inc(io_stats->reqs[op][part]);
+	this_cpu_add(io_stats->bytes[op][part], bytes);
+	this_cpu_add(io_stats->segs[op][part], blk_rq_nr_phys_segments(rq));
+	this_cpu_inc(io_stats->lat[op][min(fls64(ns), RB_LAT_BUCKETS - 1)]);
+	if (status != BLK_STS_OK)
+		this_cpu_inc(io_stats->errors[op]);
+}
+
+/* Sums all CPUs into sum */
+static void rb_stats_fold(struct rb_io_stats *sum)
+{
+	int cpu, i, op, part;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu)
+	{
+		const struct rb_io_stats *st = per_cpu_ptr(io_stats, cpu);
+
+		for (op = 0; op < RB_NR_OPS; op++)
+		{
+			for (part = 0; part < RB_NR_PARTS; part++)
+			{
+				sum->reqs[op][part] += st->reqs[op][part];
+				sum->bytes[op][part] += st->bytes[op][part];
+				sum->segs[op][part] += st->segs[op][part];
+			}
+			for (i = 0; i < RB_LAT_BUCKETS; i++)
+				sum->lat[op][i] += st->lat[op][i];
+			sum->errors[op] += st->errors[op];
+		}
+	}
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct rb_io_stats *sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	int op, part;
+
+	if (!sum)
+		return -ENOMEM;
+	rb_stats_fold(sum);
+
+	seq_printf(m, "%-5s %-6s %12s %16s %12s %10s\n",
+		   "part", "op", "requests", "bytes", "segments", "segs/req");
+	for (part = 0; part < RB_NR_PARTS; part++)
+	{
+		for (op = 0; op < RB_NR_OPS; op++)
+		{
+			u64 reqs = sum->reqs[op][part];
+			u64 segs = sum->segs[op][part];
+
+			seq_printf(m, "%-5s %-6s %12llu %16llu %12llu %10llu\n",
+				   rb_part_names[part], rb_op_names[op], reqs,
+				   sum->bytes[op][part], segs, reqs ? div64_u64(segs, reqs) : 0);
+		}
+	}
+	for (op = 0; op < RB_NR_OPS; op++)
+		seq_printf(m, "%s errors: %llu\n", rb_op_names[op], sum->errors[op]);
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int latency_show(struct seq_file *m, void *v)
+{
+	struct rb_io_stats *sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	int op, i;
+
+	if (!sum)
+		return -ENOMEM;
+	rb_stats_fold(sum);
+
+	for (op = 0; op < RB_NR_OPS; op++)
+	{
+		seq_printf(m, "%s (ns):\n", rb_op_names[op]);
+		for (i = 0; i < RB_LAT_BUCKETS; i++)
+		{
+			if (!sum->lat[op][i])
+				continue;
+			// rb_account clamps longer latencies into the last bucket
+			if (i == RB_LAT_BUCKETS - 1)
+				seq_printf(m, "  [%llu, inf) %llu\n", 1ULL << (i - 1), sum->lat[op][i]);
+			else
+				seq_printf(m, "  [%llu, %llu) %llu\n",
+					   i ? 1ULL << (i - 1) : 0, 1ULL << i, sum->lat[op][i]);
+		}
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/* Any write zeroes the counters; updates racing with it may survive */
+static ssize_t reset_write(struct file *file, const char __user *ubuf, size_t len, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(io_stats, cpu), 0, sizeof(struct rb_io_stats));
+	return len;
+}
+
+static const struct file_operations reset_fops = {
+	.owner = THIS_MODULE,
+	.write = reset_write,
+};
+
+static int rb_stats_init(void)
+{
+	io_stats = alloc_percpu(struct rb_io_stats);
+	if (!io_stats)
+		return -ENOMEM;
+
+	debugfs_dir = debugfs_create_dir(DEV_NAME, NULL);
+	debugfs_create_file("stats", 0444, debugfs_dir, NULL, &stats_fops);
+	debugfs_create_file("latency", 0444, debugfs_dir, NULL, &latency_fops);
+	debugfs_create_file("reset", 0200, debugfs_dir, NULL, &reset_fops);
+	return 0;
+}
+
+static void rb_stats_cleanup(void)
+{
+	debugfs_remove_recursive(debugfs_dir);
+	free_percpu(io_stats);
+}
+
+//------------------------------------------------------------------------
+
+/*
+	Block layer compatibility
+
+	The driver is written against blk_mq_alloc_disk() with queue_limits
+	(6.9+). The helpers below give the kernels the labs were written for
+	the same interface.
+*/
+
+#define RB_MINORS 8
+#define RB_MAX_HW_SECTORS 2560 // 1.25 MiB, the usual block layer default
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#define RB_MQ_FLAGS 0 // merging is the default
+#else
+#define RB_MQ_FLAGS BLK_MQ_F_SHOULD_MERGE
+#endif
+
+static struct gendisk *rb_alloc_disk(struct blk_mq_tag_set *set, struct queue_limits *lim,
+				     bool write_cache, void *data)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	if (write_cache)
+		lim->features |= BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA;
+	return blk_mq_alloc_disk(set, lim, data);
+#else
+	struct gendisk *gd;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	gd = blk_mq_alloc_disk(set, lim, data);
+	if (IS_ERR(gd))
+		return gd;
+#else
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	gd = blk_mq_alloc_disk(set, data);
+	if (IS_ERR(gd))
+		return gd;
+#else
+	struct request_queue *q = blk_mq_init_queue(set);
+
+	if (IS_ERR(q))
+		return ERR_CAST(q);
+	gd = alloc_disk(RB_MINORS);
+	if (!gd)
+	{
+		blk_cleanup_queue(q);
+		return ERR_PTR(-ENOMEM);
+	}
+	gd->queue = q;
+	q->queuedata = data;
+#endif
+	blk_queue_logical_block_size(gd->queue, lim->logical_block_size);
+	blk_queue_physical_block_size(gd->queue, lim->physical_block_size);
+	blk_queue_max_hw_sectors(gd->queue, lim->max_hw_sectors);
+	blk_queue_max_segments(gd->queue, lim->max_segments);
+#endif
+	blk_queue_write_cache(gd->queue, write_cache, write_cache);
+	return gd;
+#endif
+}
+
+/* Drops the disk and, on kernels that still separate them, its queue */
+static void rb_free_disk(struct gendisk *gd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	put_disk(gd);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	blk_cleanup_disk(gd);
+#else
+	struct request_queue *q = gd->queue;
+
+	put_disk(gd);
+	blk_cleanup_queue(q);
+#endif
+}
+
+static int rb_add_disk(struct gendisk *gd, const struct attribute_group **groups)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	return device_add_disk(NULL, gd, groups);
+#else
+	device_add_disk(NULL, gd, groups);
+	return 0;
+#endif
+}
+
+//------------------------------------------------------------------------
+
+/*
+	Block device functions and structures
+*/
+
+static int major = 0;
+
+static struct ram_device
+{
+	unsigned int size;
+	u8 * data;
+	struct page **pages; // backing pages of data, placed by numa_policy
+	unsigned long nr_pages;
+	struct blk_mq_tag_set tag_set;
+	struct request_queue *queue;
+	struct gendisk *gd;
+} device;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static int bdev_open(struct gendisk *gd, blk_mode_t mode)
+#else
+static int bdev_open(struct block_device *bdev, fmode_t mode)
+#endif
+{
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static void bdev_release(struct gendisk *gd)
+#else
+static void bdev_release(struct gendisk *gd, fmode_t mode)
+#endif
+{
+}
+
+static struct block_device_operations fops =
+	{
+		.owner = THIS_MODULE,
+		.open = bdev_open,
+		.release = bdev_release,
+};
+
+static int rb_copy(sector_t sector, u8 *buffer, unsigned int len, int dir)
+{
+	size_t pos;
+
+	if (rb_cache_mode())
+	{
+		return rb_cache_copy(sector, buffer, len, dir);
+	}
+
+	pos = sector * SECTOR_SIZE;
+	while (len)
+	{
+		// copy whole runs of pages that sit on the same node
+		pgoff_t idx = pos >> PAGE_SHIFT;
+		int node = page_to_nid(device.pages[idx]);
+		unsigned int n = PAGE_SIZE - offset_in_page(pos);
+
+		while (n < len && page_to_nid(device.pages[++idx]) == node)
+		{
+			n += PAGE_SIZE;
+		}
+		n = min(n, len);
+
+		if (dir == WRITE)
+		{
+			memcpy((device.data) + pos, buffer, n);
+		}
+		else
+		{
+			memcpy(buffer, (device.data) + pos, n);
+		}
+		rb_numa_account(node, dir, n);
+
+		buffer += n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copies one request segment starting at sector, returns the sectors it covered */
+static int rb_copy_bvec(const struct bio_vec *bv, sector_t sector, int dir)
+{
+	u8 *buffer = page_address(bv->bv_page) + bv->bv_offset;
+
+	if (bv->bv_len % SECTOR_SIZE != 0)
+	{
+		printk(KERN_ERR "bio size is not a multiple ofsector size\n");
+		return -EIO;
+	}
+	if (rb_copy(sector, buffer, bv->bv_len, dir) != 0)
+	{
+		return -EIO;
+	}
+	return bv->bv_len / SECTOR_SIZE;
+}
+
+/* FUA writes must reach the backing tier before completion */
+static int rb_fua(struct request *req)
+{
+	if (rb_cache_mode() && rq_data_dir(req) == WRITE && (req->cmd_flags & REQ_FUA))
+	{
+		return rb_cache_flush_range(blk_rq_pos(req), blk_rq_sectors(req));
+	}
+	return 0;
+}
+
+static int rb_transfer(struct request *req, unsigned int *nr_bytes)
+{
+	int dir = rq_data_dir(req);
+	int ret = 0;
+	sector_t start_sector = blk_rq_pos(req);
+	unsigned int sector_cnt = blk_rq_sectors(req);
+	struct bio_vec bv;
+	struct req_iterator iter;
+	sector_t sector_offset;
+	int sectors;
+	sector_offset = 0;
+	rq_for_each_segment(bv, req, iter)
+	{
+		sectors = rb_copy_bvec(&bv, start_sector + sector_offset, dir);
+		if (sectors < 0)
+		{
+			ret = sectors;
+			break;
+		}
+		sector_offset += sectors;
+		*nr_bytes += bv.bv_len;
+	}
+
+	if (ret == 0 && sector_offset != sector_cnt)
+	{
+		printk("mydisk: bio info doesn't match with the request info");
+		ret = -EIO;
+	}
+
+	if (ret == 0)
+	{
+		ret = rb_fua(req);
+	}
+	return ret;
+}
+
+//------------------------------------------------------------------------
+
+/*
+	Parallel copy of large requests
+
+	A request of at least parallel_kb is cut into up to RB_MAX_CHUNKS
+	chunks of whole segments, each at least chunk_kb long. The submitting
+	CPU copies the first chunk and the lab2_copy workqueue the others, so
+	a single large request is copied by several cores at once. Whoever
+	copies the last chunk completes the request.
+
+	The chunks live in the request PDU, which only has room for them if
+	parallel_kb was set at load; otherwise requests are always copied in
+	place, whatever parallel_kb is changed to later.
+*/
+
+static unsigned int parallel_kb = 0;
+module_param(parallel_kb, uint, 0644);
+MODULE_PARM_DESC(parallel_kb, "copy requests of at least this many KiB in parallel, 0 disables");
+
+static unsigned int chunk_kb = 256;
+module_param(chunk_kb, uint, 0644);
+MODULE_PARM_DESC(chunk_kb, "smallest chunk in KiB of a parallel copy");
+
+static unsigned int max_hw_kb = RB_MAX_HW_SECTORS / 2;
+module_param(max_hw_kb, uint, 0);
+MODULE_PARM_DESC(max_hw_kb, "largest request in KiB the disk accepts");
+
+#define RB_MAX_CHUNKS 16
+
+struct rb_chunk
+{
+	struct work_struct work;
+	struct request *rq;
+	struct bio *bio; // the chunk starts at this segment
+	struct bvec_iter iter;
+	sector_t sector;
+	unsigned int bytes;
+};
+
+/* Per-request data, blk-mq allocates it next to every request */
+struct rb_cmd
+{
+	u64 start_ns;
+	atomic_t pending; // chunks still being copied
+	int error;
+	struct rb_chunk chunks[]; // RB_MAX_CHUNKS if rb_parallel, else none
+};
+
+static bool rb_parallel; // PDUs have room for the chunks
+static struct workqueue_struct *copy_wq;
+
+static void rb_end_request(struct request *rq, unsigned int nr_bytes, blk_status_t status)
+{
+	struct rb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	/* Before blk_update_request, which advances the request position */
+	trace_lab2_rq_done(rq, nr_bytes, blk_status_to_errno(status));
+	rb_account(rq, nr_bytes, status, ktime_get_ns() - cmd->start_ns);
+
+	/* Notify kernel about processed nr_bytes, a failed request ends whole */
+	if (blk_update_request(rq, status, status == BLK_STS_OK ? nr_bytes : blk_rq_bytes(rq)))
+	{
+		/* Shouldn't fail */
+		BUG();
+	}
+
+	/* Stop request serving procedure */
+	__blk_mq_end_request(rq, status);
+}
+
+static int rb_copy_chunk(const struct rb_chunk *c)
+{
+	int dir = rq_data_dir(c->rq);
+	struct bio *bio = c->bio;
+	struct bvec_iter iter = c->iter;
+	sector_t sector = c->sector;
+	unsigned int left = c->bytes;
+	struct bio_vec bv;
+	int sectors;
+
+	while (left && bio)
+	{
+		__bio_for_each_segment(bv, bio, iter, iter)
+		{
+			if (!left)
+				break;
+			sectors = rb_copy_bvec(&bv, sector, dir);
+			if (sectors < 0)
+				return sectors;
+			sector += sectors;
+			left -= bv.bv_len;
+		}
+		bio = bio->bi_next;
+		if (bio)
+			iter = bio->bi_iter;
+	}
+	return left ? -EIO : 0;
+}
+
+static void rb_chunk_done(struct rb_chunk *c, int err)
+{
+	struct request *rq = c->rq;
+	struct rb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	if (err)
+		WRITE_ONCE(cmd->error, err);
+	// the full barrier of atomic_dec_and_test publishes every chunk's copy
+	if (!atomic_dec_and_test(&cmd->pending))
+		return;
+
+	err = READ_ONCE(cmd->error);
+	if (err == 0)
+		err = rb_fua(rq);
+	rb_end_request(rq, err ? 0 : blk_rq_bytes(rq), errno_to_blk_status(err));
+}
+
+static void rb_chunk_work(struct work_struct *work)
+{
+	struct rb_chunk *c = container_of(work, struct rb_chunk, work);
+
+	rb_chunk_done(c, rb_copy_chunk(c));
+}
+
+/* Starts a parallel copy of rq, false if rq should be copied in place */
+static bool rb_transfer_parallel(struct request *rq)
+{
+	struct rb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	unsigned int total = blk_rq_bytes(rq);
+	unsigned int threshold = READ_ONCE(parallel_kb) * 1024;
+	unsigned int chunk, nr = 0, i;
+	sector_t sector = blk_rq_pos(rq);
+	struct rb_chunk *c = NULL;
+	struct req_iterator iter;
+	struct bio_vec bv;
+
+	if (!rb_parallel || threshold == 0 || total < threshold)
+		return false;
+
+	// chunks of at least total / RB_MAX_CHUNKS never need more than RB_MAX_CHUNKS
+	chunk = max(READ_ONCE(chunk_kb) * 1024, DIV_ROUND_UP(total, RB_MAX_CHUNKS));
+	rq_for_each_segment(bv, rq, iter)
+	{
+		if (c == NULL || c->bytes >= chunk)
+		{
+			c = &cmd->chunks[nr++];
+			c->rq = rq;
+			c->bio = iter.bio;
+			c->iter = iter.iter;
+			c->sector = sector;
+			c->bytes = 0;
+		}
+		c->bytes += bv.bv_len;
+		sector += bv.bv_len / SECTOR_SIZE;
+	}
+
+	// rb_transfer reports malformed requests
+	if (nr < 2 || sector != blk_rq_pos(rq) + blk_rq_sectors(rq))
+		return false;
+
+	cmd->error = 0;
+	atomic_set(&cmd->pending, nr);
+	for (i = 1; i < nr; i++)
+	{
+		INIT_WORK(&cmd->chunks[i].work, rb_chunk_work);
+		queue_work(copy_wq, &cmd->chunks[i].work);
+	}
+	// the submitter copies one chunk itself instead of idling
+	rb_chunk_done(&cmd->chunks[0], rb_copy_chunk(&cmd->chunks[0]));
+	return true;
+}
+
+static blk_status_t queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data* bd)
+{
+    unsigned int nr_bytes = 0;
+    blk_status_t status = BLK_STS_OK;
+    struct request *rq = bd->rq;
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    cmd->start_ns = ktime_get_ns();
+
+    /* Start request serving procedure */
+    blk_mq_start_request(rq);
+    trace_lab2_rq_start(rq);
+
+    if (req_op(rq) == REQ_OP_FLUSH) {
+        /* Only advertised in cache mode */
+        if (rb_cache_mode() && rb_cache_flush() != 0) {
+            status = BLK_STS_IOERR;
+        }
+    } else if (rb_transfer_parallel(rq)) {
+        /* Completed by whoever copies the last chunk */
+        return BLK_STS_OK;
+    } else if (rb_transfer(rq, &nr_bytes) != 0) {
+        status = BLK_STS_IOERR;
+    }
+
+    rb_end_request(rq, nr_bytes, status);
+
+    /* The error, if any, was reported with the request */
+    return BLK_STS_OK;
+}
+
+static struct blk_mq_ops mq_ops = {
+    .queue_rq = queue_rq,
+    .map_queues = rb_map_queues,
+};
+
+//------------------------------------------------------------------------
+
+static int ramdisk_init(void)
+{
+	unsigned long i;
+	int err;
+
+	if ((err = rb_numa_init()) != 0)
+	{
+		return err;
+	}
+
+	if (backing)
+	{
+		if ((err = rb_cache_init()) != 0)
+		{
+			printk(KERN_ERR DEV_NAME " : can't use %s as backing, error %d\n", backing, err);
+			rb_numa_cleanup();
+			return err;
+		}
+		return MEMSIZE;
+	}
+
+	device.nr_pages = DIV_ROUND_UP(MEMSIZE * SECTOR_SIZE, PAGE_SIZE);
+	device.pages = kvcalloc(device.nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!device.pages)
+	{
+		goto out_numa;
+	}
+
+	for (i = 0; i < device.nr_pages; i++)
+	{
+		device.pages[i] = alloc_pages_node(rb_page_node(i), GFP_KERNEL | __GFP_ZERO, 0);
+		if (!device.pages[i])
+		{
+			goto out_free;
+		}
+	}
+
+	// one contiguous mapping keeps the copy path a plain memcpy
+	(device.data) = vmap(device.pages, device.nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!device.data)
+	{
+		goto out_free;
+	}
+	copy_mbr_n_br(device.data);
+	return MEMSIZE;
+
+out_free:
+	while (i--)
+	{
+		__free_page(device.pages[i]);
+	}
+	kvfree(device.pages);
+out_numa:
+	rb_numa_cleanup();
+	return -ENOMEM;
+}
+
+static void ramdisk_cleanup(void)
+{
+	unsigned long i;
+
+	if (rb_cache_mode())
+	{
+		rb_cache_cleanup();
+	}
+	else
+	{
+		vunmap(device.data);
+		for (i = 0; i < device.nr_pages; i++)
+		{
+			__free_page(device.pages[i]);
+		}
+		kvfree(device.pages);
+	}
+	rb_numa_cleanup();
+}
+
+static int __init lab2_init(void)
+{
+	int size = ramdisk_init();
+	int err;
+	struct queue_limits lim = {
+		.logical_block_size = SECTOR_SIZE,
+		.physical_block_size = SECTOR_SIZE,
+		.max_hw_sectors = max_hw_kb * 2,
+		// one page per segment, a RAM disk has no reason to cap them lower
+		.max_segments = min_t(unsigned int, max_hw_kb * 1024 / PAGE_SIZE + 1, USHRT_MAX),
+	};
+
+	if (size < 0)
+	{
+		return size;
+	}
+	device.size = size;
+
+	if (rb_stats_init() != 0)
+	{
+		ramdisk_cleanup();
+		return -ENOMEM;
+	}
+	copy_wq = alloc_workqueue("lab2_copy", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!copy_wq)
+	{
+		rb_stats_cleanup();
+		ramdisk_cleanup();
+		return -ENOMEM;
+	}
+	printk(KERN_INFO "THIS IS DEVICE SIZE %d", device.size);
+
+	if ((major = register_blkdev(0, DEV_NAME)) < 0)
+	{
+		printk("Failed to register block_dev\n");
+		destroy_workqueue(copy_wq);
+		rb_stats_cleanup();
+		ramdisk_cleanup();
+		return -ENOMEM;
+	}
+
+	printk("Major Number is : %d", major);
+	device.tag_set.ops = &mq_ops;
+	device.tag_set.nr_hw_queues = rb_nr_hw_queues();
+	device.tag_set.queue_depth = 128;
+	// parallel_kb may change later, the PDU size may not
+	rb_parallel = parallel_kb != 0;
+	device.tag_set.cmd_size = sizeof(struct rb_cmd);
+	if (rb_parallel)
+	{
+		device.tag_set.cmd_size += RB_MAX_CHUNKS * sizeof(struct rb_chunk);
+	}
+	device.tag_set.numa_node = NUMA_NO_NODE;
+	device.tag_set.flags = RB_MQ_FLAGS;
+	// cache misses read the backing file and may sleep
+	if (rb_cache_mode())
+	{
+		device.tag_set.flags |= BLK_MQ_F_BLOCKING;
+	}
+	if (blk_mq_alloc_tag_set(&device.tag_set))
+	{
+		printk("Failed alloc tag set\n");
+		unregister_blkdev(major, DEV_NAME);
+		destroy_workqueue(copy_wq);
+		rb_stats_cleanup();
+		ramdisk_cleanup();
+		return -ENOMEM;
+	}
+
+	// flush and FUA only mean something when there is a persistent tier
+	device.gd = rb_alloc_disk(&device.tag_set, &lim, rb_cache_mode(), &device);
+	if (IS_ERR(device.gd))
+	{
+		printk(KERN_INFO "Failed alloc disk\n");
+		blk_mq_free_tag_set(&device.tag_set);
+		unregister_blkdev(major, DEV_NAME);
+		destroy_workqueue(copy_wq);
+		rb_stats_cleanup();
+		ramdisk_cleanup();
+		return -ENOMEM;
+	}
+	device.queue = device.gd->queue;
+
+    device.gd->major = major;
+    device.gd->first_minor = 0;
+    device.gd->minors = RB_MINORS;
+	device.gd->fops = &fops;
+	device.gd->private_data = &device;
+
+    sprintf(((device.gd)->disk_name), DEV_NAME);
+	set_capacity(device.gd, device.size);
+	if ((err = rb_add_disk(device.gd, disk_attr_groups)) != 0)
+	{
+		printk(KERN_INFO "Failed add disk\n");
+		rb_free_disk(device.gd);
+		blk_mq_free_tag_set(&device.tag_set);
+		unregister_blkdev(major, DEV_NAME);
+		destroy_workqueue(copy_wq);
+		rb_stats_cleanup();
+		ramdisk_cleanup();
+		return err;
+	}
+	return 0;
+}
+
+static void __exit lab2_exit(void)
+{
+	del_gendisk(device.gd);
+	rb_free_disk(device.gd);
+	blk_mq_free_tag_set(&device.tag_set);
+	unregister_blkdev(major, DEV_NAME);
+	destroy_workqueue(copy_wq);
+	rb_stats_cleanup();
+	ramdisk_cleanup();
+}
+
+//------------------------------------------------------------------------
+
+module_init(lab2_init);
+module_exit(lab2_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("luribina");
+MODULE_DESCRIPTION("io lab2");
+MODULE_VERSION("1.0");
+
+#ifdef LAB2_KUNIT
+#include "lab2_test.c"
+#endif
 
 
 //      |\      _,,,---,,_
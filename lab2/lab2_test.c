@@ -0,0 +1,216 @@
+/*
+	KUnit suites for segment copies, built into lab2.ko with
+	"make KUNIT=y" and included at the end of lab2.c, so the static
+	functions are in scope. tests/kunit.sh runs them under UML.
+
+	The suites run once the module is live and copy through the real
+	disk, in RAM or in cache mode. Each test saves the sectors it uses
+	and puts them back afterwards.
+*/
+
+#include <kunit/test.h>
+
+#define RB_TEST_SECTOR (PART1_SIZE + 2048) // page aligned, inside p2
+#define RB_TEST_BYTES (64 * 1024)
+
+static_assert(RB_TEST_SECTOR % RB_SECT_PER_PAGE == 0);
+static_assert(RB_TEST_SECTOR + RB_TEST_BYTES / SECTOR_SIZE <= MEMSIZE);
+
+struct rb_test
+{
+	u8 *saved; // disk contents under test
+	u8 *buf;   // page aligned and physically contiguous
+	u8 *check;
+};
+
+static int rb_test_init(struct kunit *test)
+{
+	struct rb_test *t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	int err;
+
+	if (t == NULL)
+	{
+		return -ENOMEM;
+	}
+	// power of two kmalloc sizes are naturally aligned
+	t->saved = kunit_kmalloc(test, RB_TEST_BYTES, GFP_KERNEL);
+	t->buf = kunit_kmalloc(test, RB_TEST_BYTES, GFP_KERNEL);
+	t->check = kunit_kmalloc(test, RB_TEST_BYTES, GFP_KERNEL);
+	if (t->saved == NULL || t->buf == NULL || t->check == NULL)
+	{
+		return -ENOMEM;
+	}
+	if ((err = rb_copy(RB_TEST_SECTOR, t->saved, RB_TEST_BYTES, READ)) != 0)
+	{
+		return err;
+	}
+	test->priv = t;
+	return 0;
+}
+
+static void rb_test_exit(struct kunit *test)
+{
+	struct rb_test *t = test->priv;
+
+	// exit also runs after a failed init
+	if (t != NULL)
+	{
+		rb_copy(RB_TEST_SECTOR, t->saved, RB_TEST_BYTES, WRITE);
+	}
+}
+
+static struct bio_vec rb_test_bvec(u8 *buf, unsigned int len)
+{
+	struct bio_vec bv = {
+		.bv_page = virt_to_page(buf),
+		.bv_offset = offset_in_page(buf),
+		.bv_len = len,
+	};
+	return bv;
+}
+
+static void rb_test_fill(u8 *buf, unsigned int len, u8 seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+	{
+		buf[i] = i * 7 + seed;
+	}
+}
+
+/*
+	Writes len bytes from buf + offset at sector, reads them back into
+	check + offset and compares both, and the disk memory in RAM mode
+*/
+static void rb_test_roundtrip(struct kunit *test, unsigned int offset, unsigned int len, sector_t sector)
+{
+	struct rb_test *t = test->priv;
+	struct bio_vec bv;
+
+	rb_test_fill(t->buf + offset, len, (u8)sector);
+	memset(t->check, 0, RB_TEST_BYTES);
+
+	bv = rb_test_bvec(t->buf + offset, len);
+	KUNIT_ASSERT_EQ(test, rb_copy_bvec(&bv, sector, WRITE), (int)(len / SECTOR_SIZE));
+	if (!rb_cache_mode())
+	{
+		KUNIT_EXPECT_EQ(test, memcmp(device.data + sector * SECTOR_SIZE, t->buf + offset, len), 0);
+	}
+
+	bv = rb_test_bvec(t->check + offset, len);
+	KUNIT_ASSERT_EQ(test, rb_copy_bvec(&bv, sector, READ), (int)(len / SECTOR_SIZE));
+	KUNIT_EXPECT_EQ(test, memcmp(t->check + offset, t->buf + offset, len), 0);
+	// nothing around the segment was touched
+	KUNIT_EXPECT_PTR_EQ(test, memchr_inv(t->check, 0, offset), NULL);
+	KUNIT_EXPECT_PTR_EQ(test, memchr_inv(t->check + offset + len, 0, RB_TEST_BYTES - offset - len), NULL);
+}
+
+static void rb_test_aligned(struct kunit *test)
+{
+	rb_test_roundtrip(test, 0, SECTOR_SIZE, RB_TEST_SECTOR);
+	rb_test_roundtrip(test, 0, PAGE_SIZE, RB_TEST_SECTOR);
+	rb_test_roundtrip(test, PAGE_SIZE, PAGE_SIZE, RB_TEST_SECTOR + RB_SECT_PER_PAGE);
+}
+
+static void rb_test_misaligned(struct kunit *test)
+{
+	static const unsigned int partial[] = {1, SECTOR_SIZE - 1, SECTOR_SIZE + 1, 2 * SECTOR_SIZE - 8};
+	struct rb_test *t = test->priv;
+	struct bio_vec bv;
+	unsigned int i;
+
+	// the buffer may sit anywhere in its page, the sector anywhere on disk
+	rb_test_roundtrip(test, 100, SECTOR_SIZE, RB_TEST_SECTOR + 1);
+	rb_test_roundtrip(test, SECTOR_SIZE, 3 * SECTOR_SIZE, RB_TEST_SECTOR + 3);
+
+	// partial sectors are refused and leave the disk alone
+	for (i = 0; i < ARRAY_SIZE(partial); i++)
+	{
+		rb_copy(RB_TEST_SECTOR, t->check, 2 * SECTOR_SIZE, READ);
+		rb_test_fill(t->buf, partial[i], 0x5a);
+		bv = rb_test_bvec(t->buf, partial[i]);
+		KUNIT_EXPECT_EQ_MSG(test, rb_copy_bvec(&bv, RB_TEST_SECTOR, WRITE), -EIO, "len %u", partial[i]);
+		rb_copy(RB_TEST_SECTOR, t->buf, 2 * SECTOR_SIZE, READ);
+		KUNIT_EXPECT_EQ(test, memcmp(t->buf, t->check, 2 * SECTOR_SIZE), 0);
+	}
+}
+
+static void rb_test_straddle(struct kunit *test)
+{
+	// the buffer crosses a page of memory, the sectors a page of the disk
+	rb_test_roundtrip(test, PAGE_SIZE - SECTOR_SIZE, 2 * SECTOR_SIZE, RB_TEST_SECTOR + RB_SECT_PER_PAGE - 1);
+	// one bvec over several contiguous pages, as merged multi-page segments are
+	rb_test_roundtrip(test, SECTOR_SIZE, 4 * PAGE_SIZE, RB_TEST_SECTOR + 3);
+	rb_test_roundtrip(test, 0, RB_TEST_BYTES, RB_TEST_SECTOR);
+}
+
+static struct kunit_case rb_test_cases[] = {
+	KUNIT_CASE(rb_test_aligned),
+	KUNIT_CASE(rb_test_misaligned),
+	KUNIT_CASE(rb_test_straddle),
+	{}};
+
+static struct kunit_suite rb_test_suite = {
+	.name = "lab2_copy",
+	.init = rb_test_init,
+	.exit = rb_test_exit,
+	.test_cases = rb_test_cases,
+};
+
+/*
+	Microbenchmarks: report ns/op and MB/s of rb_copy_bvec as a
+	diagnostic line, they only fail if the copy does.
+*/
+
+#define RB_BENCH_BYTES (64 * 1024 * 1024) // copied per direction and size
+
+static void rb_bench_size(struct kunit *test, unsigned int len, unsigned int offset)
+{
+	struct rb_test *t = test->priv;
+	struct bio_vec bv = rb_test_bvec(t->buf + offset, len);
+	unsigned int iters = RB_BENCH_BYTES / len, i;
+	sector_t sector = RB_TEST_SECTOR + offset / SECTOR_SIZE;
+	int dir, ret = 0;
+	u64 start, ns[2];
+
+	for (dir = READ; dir <= WRITE; dir++)
+	{
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++)
+		{
+			ret = rb_copy_bvec(&bv, sector, dir);
+			if (ret < 0)
+			{
+				break;
+			}
+		}
+		ns[dir] = max_t(u64, ktime_get_ns() - start, 1);
+		KUNIT_ASSERT_EQ(test, ret, (int)(len / SECTOR_SIZE));
+	}
+
+	kunit_info(test, "%u bytes at +%u: read %llu ns/op %llu MB/s, write %llu ns/op %llu MB/s\n", len, offset,
+			   div_u64(ns[READ], iters), div64_u64((u64)RB_BENCH_BYTES * 1000, ns[READ]),
+			   div_u64(ns[WRITE], iters), div64_u64((u64)RB_BENCH_BYTES * 1000, ns[WRITE]));
+}
+
+static void rb_bench_copy(struct kunit *test)
+{
+	rb_bench_size(test, SECTOR_SIZE, 0);
+	rb_bench_size(test, PAGE_SIZE, 0);
+	rb_bench_size(test, PAGE_SIZE, SECTOR_SIZE);
+	rb_bench_size(test, RB_TEST_BYTES / 2, 0);
+}
+
+static struct kunit_case rb_bench_cases[] = {
+	KUNIT_CASE(rb_bench_copy),
+	{}};
+
+static struct kunit_suite rb_bench_suite = {
+	.name = "lab2_copy_bench",
+	.init = rb_test_init,
+	.exit = rb_test_exit,
+	.test_cases = rb_bench_cases,
+};
+
+kunit_test_suites(&rb_test_suite, &rb_bench_suite);
@@ -0,0 +1,76 @@
+/*
+ * Tracepoints of lab2, system "lab2".
+ *
+ * queue_rq fires rq_start when it picks up a request. rq_done fires right
+ * before the request is ended, on the CPU that finished it, which for a
+ * parallel copy may be a lab2_copy worker. rq identifies the request
+ * between the two events, trace/latency.bt uses it to build per-op
+ * latency histograms.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lab2
+
+#if !defined(LAB2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LAB2_TRACE_H
+
+#include <linux/blk-mq.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lab2_rq_start,
+
+    TP_PROTO(struct request *rq),
+
+    TP_ARGS(rq),
+
+    TP_STRUCT__entry(
+        __field(const void *, rq)
+        __field(sector_t, sector)
+        __field(unsigned int, bytes)
+        __field(unsigned int, op)
+    ),
+
+    TP_fast_assign(
+        __entry->rq = rq;
+        __entry->sector = blk_rq_pos(rq);
+        __entry->bytes = blk_rq_bytes(rq);
+        __entry->op = req_op(rq);
+    ),
+
+    TP_printk("rq=%p sector=%llu bytes=%u op=%u", __entry->rq, (unsigned long long)__entry->sector,
+              __entry->bytes, __entry->op)
+);
+
+TRACE_EVENT(lab2_rq_done,
+
+    TP_PROTO(struct request *rq, unsigned int bytes, int error),
+
+    TP_ARGS(rq, bytes, error),
+
+    TP_STRUCT__entry(
+        __field(const void *, rq)
+        __field(sector_t, sector)
+        __field(unsigned int, bytes)
+        __field(unsigned int, op)
+        __field(int, error)
+    ),
+
+    TP_fast_assign(
+        __entry->rq = rq;
+        __entry->sector = blk_rq_pos(rq);
+        __entry->bytes = bytes;
+        __entry->op = req_op(rq);
+        __entry->error = error;
+    ),
+
+    TP_printk("rq=%p sector=%llu bytes=%u op=%u error=%d", __entry->rq, (unsigned long long)__entry->sector,
+              __entry->bytes, __entry->op, __entry->error)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lab2_trace
+#include <trace/define_trace.h>
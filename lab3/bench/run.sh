@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# Measures the packet rate lab3.ko sustains. pktgen in a network
+# namespace sends UDP over a veth pair to lab3v0; veth delivers on the
+# sending CPU, so the rate and CPU time of the pktgen CPU include the
+# whole receive path, lab3's rx handler among it. No NIC is needed.
+#
+# Every size/flow combination runs in each mode:
+#   unloaded - without lab3.ko, the baseline cost of the stack
+#   nomatch  - lab3.ko watches lab3v0, no rule matches the traffic
+#   match    - lab3.ko watches lab3v0, every packet matches
+#   xdp      - as match, classified by xdp/lab3_xdp.o (make xdp)
+#
+# Optional:
+#   MODES="unloaded nomatch match" SIZES="64 512 1500" FLOWS="1 1024"
+#   PKTS=2000000                  - packets per run
+#   CPU=0                         - CPU of the pktgen thread
+#   MODULE_ARGS="sample_rate=..." - extra insmod parameters
+#   RESULTS=bench/results.json
+#
+# Run as root from a built tree (make).
+
+set -eu
+
+cd "$(dirname "$0")/.."
+
+: "${MODES:=unloaded nomatch match}"
+: "${SIZES:=64 512 1500}"
+: "${FLOWS:=1 1024}"
+: "${PKTS:=2000000}"
+: "${CPU:=0}"
+: "${MODULE_ARGS:=}"
+: "${RESULTS:=bench/results.json}"
+
+NS=lab3bench
+PG=/proc/net/pktgen
+DST=10.200.0.1
+
+[ -f lab3.ko ] || { echo "build lab3.ko first (make)" >&2; exit 1; }
+
+unload() {
+    if [ -e /proc/lab3_xdp ] && grep -q '^prog: /' /proc/lab3_xdp; then
+        xdp/attach.sh -d lab3v0
+    fi
+    if grep -q '^lab3 ' /proc/modules; then
+        rmmod lab3
+    fi
+}
+
+cleanup() {
+    unload || true
+    ip netns del "$NS" 2> /dev/null || true
+}
+trap cleanup EXIT
+
+modprobe pktgen
+ip netns add "$NS"
+ip link add lab3v0 type veth peer name lab3v1 netns "$NS"
+ip addr add "$DST/24" dev lab3v0
+ip link set lab3v0 up
+ip -n "$NS" addr add 10.200.0.2/24 dev lab3v1
+ip -n "$NS" link set lab3v1 up
+
+load() {
+    case $1 in
+    unloaded)
+        return
+        ;;
+    nomatch)
+        dest=10.99.99.99
+        ;;
+    *)
+        dest=$DST
+        ;;
+    esac
+    # shellcheck disable=SC2086
+    insmod lab3.ko watch=lab3v0 dest=$dest $MODULE_ARGS
+    if [ "$1" = xdp ]; then
+        xdp/attach.sh lab3v0
+    fi
+}
+
+pg() {
+    ip netns exec "$NS" sh -c "echo '$2' > $PG/$1"
+}
+
+# busy ticks (user, nice, system, irq, softirq, steal) of the pktgen CPU
+cpu_ticks() {
+    awk -v cpu="cpu$CPU" '$1 == cpu { print $2 + $3 + $4 + $7 + $8 + $9 }' /proc/stat
+}
+
+# packets the receive side dropped: the veth counter plus backlog drops
+rx_drops() {
+    total=$(cat /sys/class/net/lab3v0/statistics/rx_dropped)
+    while read -r _ dropped _; do
+        total=$((total + 0x$dropped))
+    done < /proc/net/softnet_stat
+    echo "$total"
+}
+
+# prints "pps ns_per_packet drops" for one run
+run() {
+    size=$1
+    flows=$2
+
+    pg "kpktgend_$CPU" "rem_device_all"
+    pg "kpktgend_$CPU" "add_device lab3v1"
+    pg lab3v1 "count $PKTS"
+    pg lab3v1 "pkt_size $size"
+    pg lab3v1 "clone_skb 0"
+    pg lab3v1 "dst $DST"
+    pg lab3v1 "dst_mac $(cat /sys/class/net/lab3v0/address)"
+    pg lab3v1 "udp_dst_min 9"
+    pg lab3v1 "udp_dst_max 9"
+    pg lab3v1 "udp_src_min 1024"
+    pg lab3v1 "udp_src_max $((1024 + flows - 1))"
+
+    busy0=$(cpu_ticks)
+    drops0=$(rx_drops)
+    ip netns exec "$NS" sh -c "echo start > $PG/pgctrl"
+    busy1=$(cpu_ticks)
+    drops1=$(rx_drops)
+
+    pps=$(ip netns exec "$NS" grep -o '[0-9]*pps' "$PG/lab3v1" | tr -d pps)
+    hz=$(getconf CLK_TCK)
+    ns=$(awk -v t=$((busy1 - busy0)) -v hz="$hz" -v n="$PKTS" 'BEGIN { printf "%.1f", t * 1e9 / hz / n }')
+    echo "$pps $ns $((drops1 - drops0))"
+}
+
+printf '%-9s %6s %6s %12s %10s %10s\n' mode size flows pps ns/pkt drops
+first=1
+echo "[" > "$RESULTS"
+for mode in $MODES; do
+    load "$mode"
+    for size in $SIZES; do
+        for flows in $FLOWS; do
+            set -- $(run "$size" "$flows")
+            printf '%-9s %6s %6s %12s %10s %10s\n' "$mode" "$size" "$flows" "$1" "$2" "$3"
+            [ $first -eq 1 ] || echo "," >> "$RESULTS"
+            first=0
+            printf '  {"mode": "%s", "size": %s, "flows": %s, "pps": %s, "ns_per_packet": %s, "drops": %s}' \
+                "$mode" "$size" "$flows" "$1" "$2" "$3" >> "$RESULTS"
+        done
+    done
+    unload
+done
+printf '\n]\n' >> "$RESULTS"
+echo "results written to $RESULTS"
@@ -1,258 +1,3120 @@
+#include <linux/bpf.h>
 #include <linux/etherdevice.h>
+#include <linux/ethtool.h>
+#include <linux/glob.h>
 #include <linux/in.h>
 #include <linux/inet.h>
+#include <linux/inetdevice.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/rtnetlink.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/udp.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <net/arp.h>
+#include <net/genetlink.h>
+#include <net/ipv6.h>
+
+#include "lab3_capture.h"
+#include "lab3_genl.h"
+#include "lab3_xdp.h"
+
+#define CREATE_TRACE_POINTS
+#include "lab3_trace.h"
+
+//------------------------------------------------------------------------
+
+/*
+    Virtual network interface structs and functions
+*/
+
+static char *link = "lo";
+module_param(link, charp, 0);
+
+static char *dest = "127.0.0.11";
+module_param(dest, charp, 0);
+
+static char *ifname = "vni%d";
+
+/*
+    vni0 counters are per CPU: every path that updates them runs with
+    bottom halves disabled, so a CPU never nests two writers, and
+    u64_stats_sync keeps 64-bit reads consistent on 32-bit hosts.
+*/
+struct vni_stats
+{
+    u64 rx_packets;
+    u64 rx_bytes;
+    u64 tx_packets;
+    u64 tx_bytes;
+    u64 tx_dropped;
+    u64 filtered;  // IP packets no rule watches
+    u64 malformed; // truncated or invalid IP or L4 headers
+    u64 non_ip;    // neither IPv4 nor IPv6
+    u64 unsampled;   // matched, but left out by sampling
+    u64 ratelimited; // matched and sampled, but over record_rate
+    struct u64_stats_sync syncp;
+};
+
+static struct vni_stats __percpu *stats;
+
+/* Sums the per-CPU counters into one snapshot */
+static void fold_stats(struct vni_stats *sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu)
+    {
+        const struct vni_stats *st = per_cpu_ptr(stats, cpu);
+        struct vni_stats tmp;
+        unsigned int start;
+
+        do
+        {
+            start = u64_stats_fetch_begin(&st->syncp);
+            tmp = *st;
+        } while (u64_stats_fetch_retry(&st->syncp, start));
+
+        sum->rx_packets += tmp.rx_packets;
+        sum->rx_bytes += tmp.rx_bytes;
+        sum->tx_packets += tmp.tx_packets;
+        sum->tx_bytes += tmp.tx_bytes;
+        sum->tx_dropped += tmp.tx_dropped;
+        sum->filtered += tmp.filtered;
+        sum->malformed += tmp.malformed;
+        sum->non_ip += tmp.non_ip;
+        sum->unsampled += tmp.unsampled;
+        sum->ratelimited += tmp.ratelimited;
+    }
+}
+
+/* Counters of one watched interface, kept in its rx_handler_data */
+struct watched_if
+{
+    struct watched_if_stats
+    {
+        u64 packets; // every packet seen on the interface
+        u64 bytes;
+        u64 matched; // packets that passed the filter
+        struct u64_stats_sync syncp;
+    } __percpu *stats;
+    bool xdp; // the XDP program runs on the interface, see watch_mark_xdp
+};
+
+static struct net_device *child = NULL;
+struct priv
+{
+    struct net_device *parent;
+};
+
+//------------------------------------------------------------------------
+
+/*
+    Capture rings
+
+    Every CPU owns a ring of compact binary records. check_frame is the
+    only writer of its CPU's ring and never waits, old records are simply
+    overwritten. Every slot has a seqcount around its record, readers
+    copy the rings and drop the records that were being rewritten while
+    they copied.
+*/
+
+static unsigned int ring_size = 1024;
+module_param(ring_size, uint, 0);
+MODULE_PARM_DESC(ring_size, "capture records kept per CPU (rounded up to a power of two)");
+
+struct capture_record
+{
+    u64 ts;
+    struct in6_addr saddr; // IPv4 addresses are mapped
+    struct in6_addr daddr;
+    u32 len;
+    int ifindex;
+};
+
+struct record_slot
+{
+    seqcount_t seq; // odd while the record is being written
+    struct capture_record rec;
+};
+
+struct capture_ring
+{
+    unsigned long head; // number of records ever written
+    unsigned long mask;
+    struct record_slot slots[];
+};
+
+static struct capture_ring * __percpu *rings;
+
+static void capture(const struct sk_buff *skb, const struct in6_addr *saddr, const struct in6_addr *daddr)
+{
+    struct capture_ring *ring = *this_cpu_ptr(rings);
+    unsigned long head = ring->head;
+    struct record_slot *slot = &ring->slots[head & ring->mask];
+
+    // single writer per ring in softirq context, so the raw variants suffice
+    raw_write_seqcount_begin(&slot->seq);
+    slot->rec.ts = ktime_get_real_ns();
+    slot->rec.saddr = *saddr;
+    slot->rec.daddr = *daddr;
+    slot->rec.len = skb->len;
+    slot->rec.ifindex = skb->dev->ifindex;
+    raw_write_seqcount_end(&slot->seq);
+
+    // publish the record only after it is complete
+    smp_store_release(&ring->head, head + 1);
+}
+
+static int alloc_rings(void)
+{
+    unsigned long size = roundup_pow_of_two(max(ring_size, 2U));
+    int cpu;
+
+    rings = alloc_percpu(struct capture_ring *);
+    if (rings == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct capture_ring *ring = vzalloc_node(struct_size(ring, slots, size), cpu_to_node(cpu));
+        unsigned long i;
+
+        if (ring == NULL)
+        {
+            return -ENOMEM;
+        }
+        ring->mask = size - 1;
+        for (i = 0; i < size; i++)
+        {
+            seqcount_init(&ring->slots[i].seq);
+        }
+        *per_cpu_ptr(rings, cpu) = ring;
+    }
+    return 0;
+}
+
+static void free_rings(void)
+{
+    int cpu;
+
+    if (rings == NULL)
+    {
+        return;
+    }
+    for_each_possible_cpu(cpu)
+    {
+        vfree(*per_cpu_ptr(rings, cpu));
+    }
+    free_percpu(rings);
+    rings = NULL;
+}
+
+struct capture_snapshot
+{
+    size_t count;
+    struct capture_record records[];
+};
+
+static int record_cmp(const void *a, const void *b)
+{
+    const struct capture_record *ra = a, *rb = b;
+
+    if (ra->ts == rb->ts)
+    {
+        return 0;
+    }
+    return ra->ts < rb->ts ? -1 : 1;
+}
+
+/* Copies all rings into one buffer ordered by time */
+static struct capture_snapshot *snapshot_rings(void)
+{
+    struct capture_snapshot *snap;
+    size_t max = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        max += (*per_cpu_ptr(rings, cpu))->mask + 1;
+    }
+
+    snap = kvmalloc(struct_size(snap, records, max), GFP_KERNEL);
+    if (snap == NULL)
+    {
+        return NULL;
+    }
+    snap->count = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct capture_ring *ring = *per_cpu_ptr(rings, cpu);
+        unsigned long size = ring->mask + 1;
+        unsigned long head = smp_load_acquire(&ring->head);
+        unsigned long first = head > size ? head - size : 0;
+        unsigned long i;
+
+        for (i = first; i < head; i++)
+        {
+            struct record_slot *slot = &ring->slots[i & ring->mask];
+            unsigned int seq = raw_read_seqcount(&slot->seq);
+
+            // skip a record the producer is rewriting, or was while it was copied
+            if (seq & 1)
+            {
+                continue;
+            }
+            snap->records[snap->count] = slot->rec;
+            if (!read_seqcount_retry(&slot->seq, seq))
+            {
+                snap->count++;
+            }
+        }
+    }
+
+    sort(snap->records, snap->count, sizeof(struct capture_record), record_cmp, NULL);
+    return snap;
+}
+
+//------------------------------------------------------------------------
+
+/*
+    Shared capture rings for /dev/lab3_capture
+
+    While the device is open, matched frames are copied (up to snaplen
+    bytes, starting at the link layer header) into a per-CPU ring that
+    userspace maps, see lab3_capture.h. A full ring drops the frame and
+    counts it, so the reader decides what is kept. Readers sleeping in
+    poll are woken once per wake_batch records or once per jiffy.
+
+    Userspace can write the rings, so nothing the kernel acts on is read
+    back from them: the layout and the producer index live in
+    capture_layout and capture_producer, ring->producer is only a
+    published copy, and consumer is clamped before it is used. The info
+    page may only be mapped read-only.
+*/
+
+static unsigned int snaplen = 128;
+module_param(snaplen, uint, 0);
+MODULE_PARM_DESC(snaplen, "bytes of each frame copied to /dev/lab3_capture");
+
+static unsigned int mmap_slots = 1024;
+module_param(mmap_slots, uint, 0);
+MODULE_PARM_DESC(mmap_slots, "slots per CPU in /dev/lab3_capture (rounded up to a power of two)");
+
+static unsigned int wake_batch = 64;
+module_param(wake_batch, uint, 0644);
+MODULE_PARM_DESC(wake_batch, "records between poll wakeups");
+
+static void *capture_area;
+static size_t capture_area_size;
+
+/* Authoritative copy of struct lab3_capture_info */
+static struct capture_layout
+{
+    unsigned int nr_rings;
+    size_t ring_bytes;
+    unsigned int nr_slots;
+    unsigned int slot_size;
+    unsigned int slot_offset;
+    unsigned int snaplen;
+} capture_layout;
+
+static DEFINE_PER_CPU(u64, capture_producer);
+static DEFINE_PER_CPU(u64, capture_drops);
+static atomic_t capture_users = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(capture_wait);
+static DEFINE_PER_CPU(unsigned long, capture_last_wake);
+
+static inline struct lab3_capture_ring *capture_ring(unsigned int i)
+{
+    return capture_area + PAGE_SIZE + i * capture_layout.ring_bytes;
+}
+
+static inline struct lab3_capture_slot *capture_slot(struct lab3_capture_ring *ring, u64 idx)
+{
+    void *slots = (void *)ring + capture_layout.slot_offset;
+    return slots + (idx & (capture_layout.nr_slots - 1)) * capture_layout.slot_size;
+}
+
+/* Reads the reader's index once and keeps it within the last nr_slots records */
+static inline u64 capture_consumer(struct lab3_capture_ring *ring, u64 prod)
+{
+    // pairs with the reader's release of consumer: the slots below it are free
+    u64 cons = smp_load_acquire(&ring->consumer);
+
+    if (cons > prod)
+    {
+        return prod;
+    }
+    return prod - cons > capture_layout.nr_slots ? prod - capture_layout.nr_slots : cons;
+}
+
+static void capture_frame(const struct sk_buff *skb)
+{
+    struct lab3_capture_ring *ring;
+    struct lab3_capture_slot *slot;
+    unsigned int len, caplen;
+    int mac_len;
+    u64 prod;
+
+    if (atomic_read(&capture_users) == 0)
+    {
+        return;
+    }
+
+    ring = capture_ring(smp_processor_id());
+    prod = __this_cpu_read(capture_producer);
+    if (prod - capture_consumer(ring, prod) >= capture_layout.nr_slots)
+    {
+        __this_cpu_inc(capture_drops);
+        WRITE_ONCE(ring->drops, __this_cpu_read(capture_drops));
+        return;
+    }
+
+    // lengths come from locals, the slot itself may be scribbled on by userspace
+    mac_len = skb_mac_header_was_set(skb) ? skb->data - skb_mac_header(skb) : 0;
+    len = skb->len + mac_len;
+    caplen = min(len, capture_layout.snaplen);
+    slot = capture_slot(ring, prod);
+    slot->ts_ns = ktime_get_real_ns();
+    slot->len = len;
+    slot->ifindex = skb->dev->ifindex;
+    slot->caplen = skb_copy_bits(skb, -mac_len, slot->data, caplen) ? 0 : caplen;
+
+    __this_cpu_write(capture_producer, prod + 1);
+    smp_store_release(&ring->producer, prod + 1);
+
+    if ((prod + 1) % max(READ_ONCE(wake_batch), 1U) == 0 || __this_cpu_read(capture_last_wake) != jiffies)
+    {
+        __this_cpu_write(capture_last_wake, jiffies);
+        if (wq_has_sleeper(&capture_wait))
+        {
+            wake_up_interruptible(&capture_wait);
+        }
+    }
+}
+
+static bool capture_pending(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < capture_layout.nr_rings; i++)
+    {
+        struct lab3_capture_ring *ring = capture_ring(i);
+        u64 prod = READ_ONCE(*per_cpu_ptr(&capture_producer, i));
+
+        if (prod != capture_consumer(ring, prod))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int capture_dev_open(struct inode *inode, struct file *file)
+{
+    atomic_inc(&capture_users);
+    return 0;
+}
+
+static int capture_dev_release(struct inode *inode, struct file *file)
+{
+    atomic_dec(&capture_users);
+    return 0;
+}
+
+static int capture_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    // the info page is read-only, only the rings may be mapped writable
+    if (vma->vm_pgoff == 0)
+    {
+        if (vma->vm_flags & VM_WRITE)
+        {
+            return -EPERM;
+        }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+        vm_flags_clear(vma, VM_MAYWRITE);
+#else
+        vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    }
+    return remap_vmalloc_range(vma, capture_area, vma->vm_pgoff);
+}
+
+static __poll_t capture_dev_poll(struct file *file, poll_table *wait)
+{
+    poll_wait(file, &capture_wait, wait);
+    return capture_pending() ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations capture_dev_fops = {
+    .owner = THIS_MODULE,
+    .open = capture_dev_open,
+    .release = capture_dev_release,
+    .mmap = capture_dev_mmap,
+    .poll = capture_dev_poll,
+    .llseek = noop_llseek};
+
+static struct miscdevice capture_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "lab3_capture",
+    .fops = &capture_dev_fops};
+
+static int capture_dev_init(void)
+{
+    unsigned int nr_slots = roundup_pow_of_two(max(mmap_slots, 2U));
+    unsigned int slot_size = ALIGN(sizeof(struct lab3_capture_slot) + snaplen, 8);
+    struct lab3_capture_info *info;
+    size_t ring_bytes = PAGE_ALIGN(ALIGN(sizeof(struct lab3_capture_ring), SMP_CACHE_BYTES) +
+                                   (size_t)nr_slots * slot_size);
+    int err;
+
+    capture_area_size = PAGE_SIZE + nr_cpu_ids * ring_bytes;
+    capture_area = vmalloc_user(capture_area_size);
+    if (capture_area == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    capture_layout = (struct capture_layout){
+        .nr_rings = nr_cpu_ids,
+        .ring_bytes = ring_bytes,
+        .nr_slots = nr_slots,
+        .slot_size = slot_size,
+        .slot_offset = ALIGN(sizeof(struct lab3_capture_ring), SMP_CACHE_BYTES),
+        .snaplen = snaplen,
+    };
+
+    info = capture_area;
+    info->magic = LAB3_CAPTURE_MAGIC;
+    info->version = LAB3_CAPTURE_VERSION;
+    info->nr_rings = capture_layout.nr_rings;
+    info->ring_bytes = capture_layout.ring_bytes;
+    info->nr_slots = capture_layout.nr_slots;
+    info->slot_size = capture_layout.slot_size;
+    info->slot_offset = capture_layout.slot_offset;
+    info->snaplen = capture_layout.snaplen;
+    info->linktype = 1; // LINKTYPE_ETHERNET
+
+    err = misc_register(&capture_dev);
+    if (err)
+    {
+        vfree(capture_area);
+        capture_area = NULL;
+    }
+    return err;
+}
+
+static void capture_dev_cleanup(void)
+{
+    if (capture_area == NULL)
+    {
+        return;
+    }
+    misc_deregister(&capture_dev);
+    vfree(capture_area);
+    capture_area = NULL;
+}
+
+//------------------------------------------------------------------------
+
+/*
+    Capture policy
+
+    Decides which matched packets produce records in the capture rings
+    and in /dev/lab3_capture. Counters and flows always see every packet;
+    only the detail is sampled, so the cost per packet stays bounded
+    however many of them arrive:
+      - counters_only skips records altogether;
+      - sample_rate N keeps 1 packet in N, every Nth or, with
+        sample_random, each with probability 1/N;
+      - record_rate caps the records each CPU writes per second, with
+        bursts of up to record_burst records (a token bucket).
+    All state is per CPU, so the decision takes no locks.
+*/
+
+static bool counters_only;
+module_param(counters_only, bool, 0644);
+MODULE_PARM_DESC(counters_only, "only count matched packets, write no capture records");
+
+static unsigned int sample_rate = 1;
+module_param(sample_rate, uint, 0644);
+MODULE_PARM_DESC(sample_rate, "record 1 in N matched packets (1 records all)");
+
+static bool sample_random;
+module_param(sample_random, bool, 0644);
+MODULE_PARM_DESC(sample_random, "sample at random instead of every Nth packet");
+
+static unsigned int record_rate;
+module_param(record_rate, uint, 0644);
+MODULE_PARM_DESC(record_rate, "records per second per CPU (0 is unlimited)");
+
+static unsigned int record_burst = 64;
+module_param(record_burst, uint, 0644);
+MODULE_PARM_DESC(record_burst, "records a CPU may write at once under record_rate");
+
+struct sample_state
+{
+    unsigned int seen; // packets since the last sampled one
+    u64 tokens;        // in records * NSEC_PER_SEC
+    u64 last_ns;
+};
+
+static DEFINE_PER_CPU(struct sample_state, sample_state);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define random_below(n) get_random_u32_below(n)
+#else
+#define random_below(n) prandom_u32_max(n)
+#endif
+
+static bool sample_take(struct sample_state *ss)
+{
+    unsigned int n = READ_ONCE(sample_rate);
+
+    if (n <= 1)
+    {
+        return true;
+    }
+    if (READ_ONCE(sample_random))
+    {
+        return random_below(n) == 0;
+    }
+    if (++ss->seen < n)
+    {
+        return false;
+    }
+    ss->seen = 0;
+    return true;
+}
+
+static bool sample_token(struct sample_state *ss)
+{
+    u64 rate = READ_ONCE(record_rate);
+    u64 cap = (u64)max(READ_ONCE(record_burst), 1U) * NSEC_PER_SEC;
+    u64 now, elapsed;
+
+    if (rate == 0)
+    {
+        return true;
+    }
+
+    now = ktime_get_mono_fast_ns();
+    elapsed = now - ss->last_ns;
+    ss->last_ns = now;
+    // a second refills any bucket, and keeps elapsed * rate from overflowing
+    ss->tokens = elapsed >= NSEC_PER_SEC ? cap : min(ss->tokens + elapsed * rate, cap);
+
+    if (ss->tokens < NSEC_PER_SEC)
+    {
+        return false;
+    }
+    ss->tokens -= NSEC_PER_SEC;
+    return true;
+}
+
+/* Called from check_frame for every matched packet, returns whether to record it */
+static bool capture_sample(void)
+{
+    struct sample_state *ss = this_cpu_ptr(&sample_state);
+    struct vni_stats *st = this_cpu_ptr(stats);
+    bool sampled;
+
+    if (READ_ONCE(counters_only))
+    {
+        return false;
+    }
+
+    sampled = sample_take(ss);
+    if (sampled && sample_token(ss))
+    {
+        return true;
+    }
+
+    u64_stats_update_begin(&st->syncp);
+    if (sampled)
+    {
+        st->ratelimited++;
+    }
+    else
+    {
+        st->unsampled++;
+    }
+    u64_stats_update_end(&st->syncp);
+    return false;
+}
+
+//------------------------------------------------------------------------
+
+/*
+    Address filter
+
+    Rules are CIDR prefixes on the source or the destination address and
+    the longest matching prefix wins: "watch" captures the packet,
+    "ignore" cuts a hole out of a shorter watched prefix. Each direction
+    keeps a bitmap of the prefix lengths in use, so a lookup is at most
+    one hash probe per distinct length.
+
+    Addresses are IPv6; an IPv4 rule a.b.c.d/n is stored as the mapped
+    ::ffff:a.b.c.d/(96 + n), which IPv4 packets are looked up as.
+
+    A published table is never modified. Writers build a new one under
+    filter_lock and swap it with RCU, the packet path only dereferences.
+*/
+
+static unsigned int max_rules = 65536;
+module_param(max_rules, uint, 0644);
+MODULE_PARM_DESC(max_rules, "maximum number of filter rules");
+
+enum filter_dir
+{
+    FILTER_SRC,
+    FILTER_DST,
+    FILTER_NR_DIRS,
+};
+
+enum filter_action
+{
+    FILTER_NONE, // also marks an empty hash slot
+    FILTER_WATCH,
+    FILTER_IGNORE,
+};
+
+static const char *const filter_dir_names[] = {"src", "dst"};
+static const char *const filter_action_names[] = {"none", "watch", "ignore"};
+
+#define FILTER_PLENS 129 // prefix lengths 0..128
+
+struct filter_rule
+{
+    struct in6_addr addr; // already masked
+    u8 plen;
+    u8 dir;
+    u8 action;
+};
+
+struct filter_table
+{
+    DECLARE_BITMAP(plens[FILTER_NR_DIRS], FILTER_PLENS); // bit n: some rule has prefix length n
+    unsigned int nr_rules;
+    unsigned int mask;
+    struct filter_rule *slots; // open addressing, mask + 1 entries
+    struct filter_rule rules[];
+};
+
+static struct filter_table __rcu *filter;
+static DEFINE_MUTEX(filter_lock);
+
+static inline u32 filter_hash(const struct in6_addr *addr, u8 plen, u8 dir)
+{
+    return jhash2((const u32 *)addr->s6_addr32, 4, plen | dir << 8);
+}
+
+static inline bool filter_rule_is(const struct filter_rule *r, const struct in6_addr *addr, u8 plen, u8 dir)
+{
+    return r->plen == plen && r->dir == dir && ipv6_addr_equal(&r->addr, addr);
+}
+
+static enum filter_action filter_probe(const struct filter_table *t, const struct in6_addr *addr, u8 plen,
+                                       u8 dir)
+{
+    u32 i = filter_hash(addr, plen, dir) & t->mask;
+
+    for (;; i = (i + 1) & t->mask)
+    {
+        const struct filter_rule *slot = &t->slots[i];
+
+        if (slot->action == FILTER_NONE)
+        {
+            return FILTER_NONE;
+        }
+        if (filter_rule_is(slot, addr, plen, dir))
+        {
+            return slot->action;
+        }
+    }
+}
+
+static enum filter_action filter_lookup(const struct filter_table *t, const struct in6_addr *addr, u8 dir)
+{
+    unsigned int n = FILTER_PLENS, plen;
+
+    // longest first: plen is the highest set bit below n
+    while (n > 0 && (plen = find_last_bit(t->plens[dir], n)) < n)
+    {
+        struct in6_addr prefix;
+        enum filter_action action;
+
+        ipv6_addr_prefix(&prefix, addr, plen);
+        action = filter_probe(t, &prefix, plen, dir);
+        if (action != FILTER_NONE)
+        {
+            return action;
+        }
+        n = plen;
+    }
+    return FILTER_NONE;
+}
+
+/* Called from the rx handler, under rcu_read_lock */
+static bool filter_match(const struct in6_addr *saddr, const struct in6_addr *daddr)
+{
+    const struct filter_table *t = rcu_dereference(filter);
+
+    if (t == NULL)
+    {
+        return false;
+    }
+    return filter_lookup(t, daddr, FILTER_DST) == FILTER_WATCH ||
+           filter_lookup(t, saddr, FILTER_SRC) == FILTER_WATCH;
+}
+
+/* Builds a table from nr rules; duplicates keep the last action */
+static struct filter_table *filter_build(const struct filter_rule *rules, unsigned int nr)
+{
+    unsigned int slots = roundup_pow_of_two(max(2 * nr, 16U));
+    struct filter_table *t;
+    unsigned int i;
+
+    t = kvzalloc(struct_size(t, rules, nr) + slots * sizeof(struct filter_rule), GFP_KERNEL);
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    t->mask = slots - 1;
+    t->slots = (struct filter_rule *)&t->rules[nr];
+
+    for (i = 0; i < nr; i++)
+    {
+        const struct filter_rule *r = &rules[i];
+        u32 h = filter_hash(&r->addr, r->plen, r->dir) & t->mask;
+
+        while (t->slots[h].action != FILTER_NONE && !filter_rule_is(&t->slots[h], &r->addr, r->plen, r->dir))
+        {
+            h = (h + 1) & t->mask;
+        }
+        if (t->slots[h].action == FILTER_NONE)
+        {
+            t->rules[t->nr_rules++] = *r;
+        }
+        else
+        {
+            unsigned int j;
+            for (j = 0; j < t->nr_rules; j++)
+            {
+                if (filter_rule_is(&t->rules[j], &r->addr, r->plen, r->dir))
+                {
+                    t->rules[j].action = r->action;
+                }
+            }
+        }
+        t->slots[h] = *r;
+        __set_bit(r->plen, t->plens[r->dir]);
+    }
+    return t;
+}
+
+static void filter_publish(struct filter_table *t)
+{
+    struct filter_table *old = rcu_replace_pointer(filter, t, lockdep_is_held(&filter_lock));
+
+    synchronize_rcu();
+    kvfree(old);
+}
+
+/*
+    Parses "<src|dst> <addr>[/<plen>] [watch|ignore]", addr being IPv4 or
+    IPv6. Host bits of the address are cleared.
+*/
+static int filter_parse(char *line, struct filter_rule *rule)
+{
+    char *dir = strsep(&line, " \t");
+    char *cidr = strsep(&line, " \t");
+    char *action = line ? strim(line) : NULL;
+    struct in6_addr addr;
+    const char *end;
+    u8 max_plen;
+    __be32 addr4;
+    int i;
+
+    if (dir == NULL || cidr == NULL)
+    {
+        return -EINVAL;
+    }
+
+    i = match_string(filter_dir_names, FILTER_NR_DIRS, dir);
+    if (i < 0)
+    {
+        return -EINVAL;
+    }
+    rule->dir = i;
+
+    if (in4_pton(cidr, -1, (u8 *)&addr4, '/', &end))
+    {
+        ipv6_addr_set_v4mapped(addr4, &addr);
+        max_plen = 32;
+    }
+    else if (in6_pton(cidr, -1, addr.s6_addr, '/', &end))
+    {
+        max_plen = 128;
+    }
+    else
+    {
+        return -EINVAL;
+    }
+
+    rule->plen = max_plen;
+    if (*end == '/' && kstrtou8(end + 1, 10, &rule->plen))
+    {
+        return -EINVAL;
+    }
+    if (rule->plen > max_plen)
+    {
+        return -EINVAL;
+    }
+    rule->plen += 128 - max_plen;
+    ipv6_addr_prefix(&rule->addr, &addr, rule->plen);
+
+    rule->action = FILTER_WATCH;
+    if (action != NULL && *action != '\0')
+    {
+        i = match_string(filter_action_names, ARRAY_SIZE(filter_action_names), action);
+        if (i <= FILTER_NONE)
+        {
+            return -EINVAL;
+        }
+        rule->action = i;
+    }
+    return 0;
+}
+
+/*
+    Applies one command to the rule array:
+        add <rule>  - add or update a rule
+        del <rule>  - remove a rule (the action is ignored)
+        clear       - remove all rules
+*/
+static int filter_apply(char *line, struct filter_rule *rules, unsigned int *nr, unsigned int limit)
+{
+    char *cmd = strsep(&line, " \t");
+    struct filter_rule rule;
+    unsigned int i;
+    int err;
+
+    if (strcmp(cmd, "clear") == 0)
+    {
+        *nr = 0;
+        return 0;
+    }
+    if (line == NULL)
+    {
+        return -EINVAL;
+    }
+    if ((err = filter_parse(line, &rule)) != 0)
+    {
+        return err;
+    }
+
+    if (strcmp(cmd, "add") == 0)
+    {
+        if (*nr >= limit)
+        {
+            return -ENOSPC;
+        }
+        rules[(*nr)++] = rule;
+        return 0;
+    }
+    if (strcmp(cmd, "del") == 0)
+    {
+        for (i = 0; i < *nr;)
+        {
+            if (filter_rule_is(&rules[i], &rule.addr, rule.plen, rule.dir))
+            {
+                rules[i] = rules[--(*nr)];
+            }
+            else
+            {
+                i++;
+            }
+        }
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/*
+    Runs every line of buf against the current rules and publishes the
+    result, or nothing if a line fails. max_rules only limits additions:
+    a table that is already larger after max_rules was lowered keeps all
+    its rules and can still shrink.
+*/
+static int filter_update(char *buf)
+{
+    unsigned int limit = READ_ONCE(max_rules);
+    struct filter_table *cur, *t;
+    struct filter_rule *rules;
+    unsigned int nr = 0;
+    char *line;
+    int err = 0;
+
+    mutex_lock(&filter_lock);
+    cur = rcu_dereference_protected(filter, lockdep_is_held(&filter_lock));
+    if (cur != NULL)
+    {
+        nr = cur->nr_rules;
+    }
+
+    rules = kvmalloc_array(max3(limit, nr, 1U), sizeof(*rules), GFP_KERNEL);
+    if (rules == NULL)
+    {
+        err = -ENOMEM;
+        goto out;
+    }
+    if (cur != NULL)
+    {
+        memcpy(rules, cur->rules, nr * sizeof(*rules));
+    }
+
+    while ((line = strsep(&buf, "\n")) != NULL)
+    {
+        line = strim(line);
+        if (*line == '\0' || *line == '#')
+        {
+            continue;
+        }
+        if ((err = filter_apply(line, rules, &nr, limit)) != 0)
+        {
+            goto out;
+        }
+    }
+
+    t = filter_build(rules, nr);
+    if (t == NULL)
+    {
+        err = -ENOMEM;
+        goto out;
+    }
+    filter_publish(t);
+
+out:
+    mutex_unlock(&filter_lock);
+    kvfree(rules);
+    return err;
+}
+
+static void filter_cleanup(void)
+{
+    mutex_lock(&filter_lock);
+    filter_publish(NULL);
+    mutex_unlock(&filter_lock);
+}
+
+//------------------------------------------------------------------------
+
+/*
+    XDP mode
+
+    xdp/lab3_xdp.bpf.c runs the IPv4 checks and the filter as a generic
+    XDP program, before the stack allocates an skb. It knows only IPv4,
+    so IPv6 rules are not mirrored and IPv6 frames count as non-IPv4. The program is loaded
+    and attached from userspace (xdp/attach.sh) and handed to the module
+    through /proc/lab3_xdp by its pinned path. The module then mirrors the
+    filter rules into the program's LPM tries and reads its counters. On
+    the watched interfaces that run the program, handle_frame only counts
+    frames per interface: capture, flows and vni0 rx counters stay idle
+    for them. Other watched interfaces keep the rx handler path.
+
+    The maps belong to the program, so holding the program keeps them
+    alive. They are updated under filter_lock together with the filter.
+*/
+
+struct xdp_state
+{
+    struct bpf_prog *prog;
+    struct bpf_map *maps[FILTER_NR_DIRS];
+    struct bpf_map *counters;
+    char path[64];
+};
+
+static struct xdp_state xdp;
+
+static struct bpf_map *xdp_find_map(struct bpf_prog *prog, const char *name, enum bpf_map_type type,
+                                    u32 key_size, u32 value_size)
+{
+    struct bpf_map *found = NULL;
+    unsigned int i;
+
+    // BPF_PROG_BIND_MAP may grow used_maps meanwhile; bound maps stay until the program goes
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    mutex_lock(&prog->aux->used_maps_mutex);
+#endif
+    for (i = 0; i < prog->aux->used_map_cnt; i++)
+    {
+        struct bpf_map *map = prog->aux->used_maps[i];
+
+        if (strcmp(map->name, name) == 0 && map->map_type == type && map->key_size == key_size &&
+            map->value_size == value_size)
+        {
+            found = map;
+            break;
+        }
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    mutex_unlock(&prog->aux->used_maps_mutex);
+#endif
+    return found;
+}
+
+/* Map updates from process context, the way the bpf syscall makes them */
+static int xdp_map_update(struct bpf_map *map, struct lab3_xdp_key *key, u32 action)
+{
+    int err;
+
+    rcu_read_lock();
+    preempt_disable();
+    err = map->ops->map_update_elem(map, key, &action, BPF_ANY);
+    preempt_enable();
+    rcu_read_unlock();
+    return err;
+}
+
+static int xdp_map_delete(struct bpf_map *map, struct lab3_xdp_key *key)
+{
+    int err;
+
+    rcu_read_lock();
+    preempt_disable();
+    err = map->ops->map_delete_elem(map, key);
+    preempt_enable();
+    rcu_read_unlock();
+    return err;
+}
+
+/*
+    Makes the tries equal to the filter table: new and changed rules are
+    written first, stale ones removed afterwards, so a packet never sees
+    a trie with fewer watched prefixes than either table had.
+*/
+static int xdp_sync_rules(const struct filter_table *t)
+{
+    struct lab3_xdp_key *stale, key, next, *prev;
+    struct in6_addr addr;
+    unsigned int i, nr_stale;
+    int dir, err = 0;
+
+    lockdep_assert_held(&filter_lock);
+    BUILD_BUG_ON(FILTER_WATCH != LAB3_XDP_WATCH || FILTER_IGNORE != LAB3_XDP_IGNORE);
+
+    for (i = 0; t != NULL && i < t->nr_rules; i++)
+    {
+        const struct filter_rule *r = &t->rules[i];
+
+        // the program only parses IPv4
+        if (!ipv6_addr_v4mapped(&r->addr) || r->plen < 96)
+        {
+            continue;
+        }
+        key.prefixlen = r->plen - 96;
+        key.addr = r->addr.s6_addr32[3];
+        err = xdp_map_update(xdp.maps[r->dir], &key, r->action);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    for (dir = 0; dir < FILTER_NR_DIRS; dir++)
+    {
+        struct bpf_map *map = xdp.maps[dir];
+
+        stale = kvmalloc_array(map->max_entries, sizeof(*stale), GFP_KERNEL);
+        if (stale == NULL)
+        {
+            return -ENOMEM;
+        }
+
+        nr_stale = 0;
+        prev = NULL;
+        rcu_read_lock();
+        while (nr_stale < map->max_entries && map->ops->map_get_next_key(map, prev, &next) == 0)
+        {
+            ipv6_addr_set_v4mapped(next.addr, &addr);
+            if (t == NULL || filter_probe(t, &addr, next.prefixlen + 96, dir) == FILTER_NONE)
+            {
+                stale[nr_stale++] = next;
+            }
+            key = next;
+            prev = &key;
+        }
+        rcu_read_unlock();
+
+        for (i = 0; i < nr_stale; i++)
+        {
+            xdp_map_delete(map, &stale[i]);
+        }
+        kvfree(stale);
+    }
+    return err;
+}
+
+static void xdp_detach(void)
+{
+    lockdep_assert_held(&filter_lock);
+
+    if (xdp.prog == NULL)
+    {
+        return;
+    }
+    bpf_prog_put(xdp.prog);
+    memset(&xdp, 0, sizeof(xdp));
+}
+
+static int xdp_attach(const char *path)
+{
+    struct bpf_prog *prog;
+    int dir, err;
+
+    lockdep_assert_held(&filter_lock);
+
+    prog = bpf_prog_get_type_path(path, BPF_PROG_TYPE_XDP);
+    if (IS_ERR(prog))
+    {
+        return PTR_ERR(prog);
+    }
+
+    xdp_detach();
+    xdp.prog = prog;
+    strscpy(xdp.path, path, sizeof(xdp.path));
+    xdp.maps[FILTER_SRC] = xdp_find_map(prog, LAB3_XDP_SRC_MAP, BPF_MAP_TYPE_LPM_TRIE,
+                                        sizeof(struct lab3_xdp_key), sizeof(u32));
+    xdp.maps[FILTER_DST] = xdp_find_map(prog, LAB3_XDP_DST_MAP, BPF_MAP_TYPE_LPM_TRIE,
+                                        sizeof(struct lab3_xdp_key), sizeof(u32));
+    xdp.counters = xdp_find_map(prog, LAB3_XDP_COUNTERS_MAP, BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(u32),
+                                sizeof(struct lab3_xdp_counters));
+
+    for (dir = 0; dir < FILTER_NR_DIRS; dir++)
+    {
+        if (xdp.maps[dir] == NULL)
+        {
+            xdp_detach();
+            return -EINVAL;
+        }
+    }
+    if (xdp.counters == NULL)
+    {
+        xdp_detach();
+        return -EINVAL;
+    }
+
+    err = xdp_sync_rules(rcu_dereference_protected(filter, lockdep_is_held(&filter_lock)));
+    if (err != 0)
+    {
+        xdp_detach();
+        return err;
+    }
+    return 0;
+}
+
+/* Called after every filter change */
+static void xdp_sync(void)
+{
+    int err;
+
+    mutex_lock(&filter_lock);
+    if (xdp.prog != NULL)
+    {
+        err = xdp_sync_rules(rcu_dereference_protected(filter, lockdep_is_held(&filter_lock)));
+        if (err != 0)
+        {
+            pr_err("%s: can't update XDP filter maps, error %i", THIS_MODULE->name, err);
+        }
+    }
+    mutex_unlock(&filter_lock);
+}
+
+static void xdp_fold_counters(struct lab3_xdp_counters *sum)
+{
+    struct bpf_array *array = container_of(xdp.counters, struct bpf_array, map);
+    int cpu;
+
+    lockdep_assert_held(&filter_lock);
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu)
+    {
+        const struct lab3_xdp_counters *c = per_cpu_ptr(array->pptrs[0], cpu);
+
+        sum->packets += READ_ONCE(c->packets);
+        sum->bytes += READ_ONCE(c->bytes);
+        sum->filtered += READ_ONCE(c->filtered);
+        sum->malformed += READ_ONCE(c->malformed);
+        sum->non_ipv4 += READ_ONCE(c->non_ipv4);
+    }
+}
+
+static void xdp_cleanup(void)
+{
+    mutex_lock(&filter_lock);
+    xdp_detach();
+    mutex_unlock(&filter_lock);
+}
+
+//------------------------------------------------------------------------
+
+/*
+    Flow table
+
+    Matched packets are aggregated per (saddr, daddr, protocol, ports).
+    Lookups walk an RCU hash chain; only the first packet of a flow takes
+    a bucket lock to insert it. Counters are per CPU and last_seen is
+    written at most once per jiffy, so a busy flow does not bounce cache
+    lines between CPUs. A periodic work drops flows idle for longer than
+    flow_timeout and the table never holds more than max_flows entries.
+*/
+
+static unsigned int max_flows = 65536;
+module_param(max_flows, uint, 0);
+MODULE_PARM_DESC(max_flows, "maximum number of tracked flows");
+
+static unsigned int flow_timeout = 60;
+module_param(flow_timeout, uint, 0644);
+MODULE_PARM_DESC(flow_timeout, "seconds of inactivity before a flow is dropped");
+
+// LAB3_A_FLOWS carries all of them in one attribute, whose length is a u16
+#define TOP_FLOWS_MAX 1024
+
+static unsigned int top_flows = 20;
+
+static int top_flows_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int n;
+    int err = kstrtouint(val, 0, &n);
+
+    if (err)
+    {
+        return err;
+    }
+    WRITE_ONCE(top_flows, min_t(unsigned int, n, TOP_FLOWS_MAX));
+    return 0;
+}
+
+static const struct kernel_param_ops top_flows_ops = {
+    .set = top_flows_set,
+    .get = param_get_uint,
+};
+
+module_param_cb(top_flows, &top_flows_ops, &top_flows, 0644);
+MODULE_PARM_DESC(top_flows, "number of flows shown in /proc/lab3_flows and in snapshots (at most 1024)");
+
+static bool top_by_packets = false;
+module_param(top_by_packets, bool, 0644);
+MODULE_PARM_DESC(top_by_packets, "rank flows by packets instead of bytes");
+
+#define FLOW_LOCKS 256
+
+struct flow_key
+{
+    struct in6_addr saddr; // IPv4 addresses are mapped
+    struct in6_addr daddr;
+    __be16 sport;          // ICMP type for ICMP and ICMPv6
+    __be16 dport;          // ICMP code
+    u32 proto;             // u32 keeps the key padding-free for jhash2
+};
+
+struct flow_counters
+{
+    u64 packets;
+    u64 bytes;
+};
+
+struct flow
+{
+    struct hlist_node node;
+    struct flow_key key;
+    struct flow_counters __percpu *counters;
+    unsigned long first_seen; // jiffies
+    unsigned long last_seen;
+    struct rcu_head rcu;
+};
+
+static struct hlist_head *flow_buckets;
+static unsigned int flow_mask;
+static spinlock_t flow_locks[FLOW_LOCKS];
+static atomic_t nr_flows = ATOMIC_INIT(0);
+static atomic64_t flow_drops = ATOMIC64_INIT(0);
+static struct delayed_work flow_gc_work;
+
+static inline u32 flow_hash(const struct flow_key *key)
+{
+    return jhash2((const u32 *)key, sizeof(*key) / sizeof(u32), 0);
+}
+
+/* Lock of bucket index idx; insert and GC must agree on it for any table size */
+static inline spinlock_t *flow_lock(unsigned int idx)
+{
+    return &flow_locks[idx % FLOW_LOCKS];
+}
+
+static struct flow *flow_find(const struct hlist_head *bucket, const struct flow_key *key)
+{
+    struct flow *f;
+
+    hlist_for_each_entry_rcu(f, bucket, node)
+    {
+        if (memcmp(&f->key, key, sizeof(*key)) == 0)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static struct flow *flow_create(struct hlist_head *bucket, const struct flow_key *key, u32 hash)
+{
+    struct flow *f;
+
+    spin_lock(flow_lock(hash & flow_mask));
+    // another CPU may have inserted it since the lockless lookup
+    f = flow_find(bucket, key);
+    if (f != NULL)
+    {
+        goto out;
+    }
+
+    if (atomic_read(&nr_flows) >= max_flows)
+    {
+        atomic64_inc(&flow_drops);
+        goto out;
+    }
+
+    f = kmalloc(sizeof(*f), GFP_ATOMIC);
+    if (f == NULL)
+    {
+        atomic64_inc(&flow_drops);
+        goto out;
+    }
+    f->counters = alloc_percpu_gfp(struct flow_counters, GFP_ATOMIC);
+    if (f->counters == NULL)
+    {
+        kfree(f);
+        f = NULL;
+        atomic64_inc(&flow_drops);
+        goto out;
+    }
+    f->key = *key;
+    f->first_seen = f->last_seen = jiffies;
+    hlist_add_head_rcu(&f->node, bucket);
+    atomic_inc(&nr_flows);
+out:
+    spin_unlock(flow_lock(hash & flow_mask));
+    return f;
+}
+
+/* Called from the rx handler, under rcu_read_lock */
+static void flow_account(const struct flow_key *key, unsigned int segs, unsigned int len)
+{
+    u32 hash = flow_hash(key);
+    struct hlist_head *bucket = &flow_buckets[hash & flow_mask];
+    struct flow *f = flow_find(bucket, key);
+
+    if (f == NULL && (f = flow_create(bucket, key, hash)) == NULL)
+    {
+        return;
+    }
+
+    this_cpu_add(f->counters->packets, segs);
+    this_cpu_add(f->counters->bytes, len);
+    if (READ_ONCE(f->last_seen) != jiffies)
+    {
+        WRITE_ONCE(f->last_seen, jiffies);
+    }
+}
+
+static void flow_free_rcu(struct rcu_head *head)
+{
+    struct flow *f = container_of(head, struct flow, rcu);
+    free_percpu(f->counters);
+    kfree(f);
+}
+
+static void flow_gc(struct work_struct *work)
+{
+    unsigned long timeout = (unsigned long)flow_timeout * HZ;
+    unsigned int i;
+
+    for (i = 0; i <= flow_mask; i++)
+    {
+        struct flow *f;
+        struct hlist_node *tmp;
+
+        if (hlist_empty(&flow_buckets[i]))
+        {
+            continue;
+        }
+
+        spin_lock_bh(flow_lock(i));
+        hlist_for_each_entry_safe(f, tmp, &flow_buckets[i], node)
+        {
+            if (time_after(jiffies, READ_ONCE(f->last_seen) + timeout))
+            {
+                hlist_del_rcu(&f->node);
+                atomic_dec(&nr_flows);
+                call_rcu(&f->rcu, flow_free_rcu);
+            }
+        }
+        spin_unlock_bh(flow_lock(i));
+        cond_resched();
+    }
+
+    schedule_delayed_work(&flow_gc_work, max(timeout / 2, (unsigned long)HZ));
+}
+
+static int flow_init(void)
+{
+    unsigned int i, buckets = roundup_pow_of_two(max(max_flows, 2U));
+
+    flow_buckets = kvmalloc_array(buckets, sizeof(struct hlist_head), GFP_KERNEL);
+    if (flow_buckets == NULL)
+    {
+        return -ENOMEM;
+    }
+    for (i = 0; i < buckets; i++)
+    {
+        INIT_HLIST_HEAD(&flow_buckets[i]);
+    }
+    flow_mask = buckets - 1;
+
+    for (i = 0; i < FLOW_LOCKS; i++)
+    {
+        spin_lock_init(&flow_locks[i]);
+    }
+
+    INIT_DELAYED_WORK(&flow_gc_work, flow_gc);
+    schedule_delayed_work(&flow_gc_work, HZ);
+    return 0;
+}
+
+/* Must run after the rx handlers are gone */
+static void flow_cleanup(void)
+{
+    unsigned int i;
+
+    if (flow_buckets == NULL)
+    {
+        return;
+    }
+    cancel_delayed_work_sync(&flow_gc_work);
+
+    for (i = 0; i <= flow_mask; i++)
+    {
+        struct flow *f;
+        struct hlist_node *tmp;
+
+        hlist_for_each_entry_safe(f, tmp, &flow_buckets[i], node)
+        {
+            hlist_del(&f->node);
+            free_percpu(f->counters);
+            kfree(f);
+        }
+    }
+    // wait for flow_free_rcu callbacks queued by the gc
+    rcu_barrier();
+    kvfree(flow_buckets);
+    flow_buckets = NULL;
+}
+
+struct flow_stat
+{
+    struct flow_key key;
+    u64 packets;
+    u64 bytes;
+    unsigned long first_seen;
+    unsigned long last_seen;
+};
+
+struct flow_snapshot
+{
+    size_t count;
+    struct flow_stat stats[];
+};
+
+static int flow_stat_cmp(const void *a, const void *b)
+{
+    const struct flow_stat *fa = a, *fb = b;
+    u64 va = top_by_packets ? fa->packets : fa->bytes;
+    u64 vb = top_by_packets ? fb->packets : fb->bytes;
+
+    if (va == vb)
+    {
+        return 0;
+    }
+    return va > vb ? -1 : 1;
+}
+
+/* Sums the per-CPU counters of every flow and sorts them, largest first */
+static struct flow_snapshot *snapshot_flows(void)
+{
+    size_t max = atomic_read(&nr_flows) + 64;
+    struct flow_snapshot *snap;
+    unsigned int i;
+
+    snap = kvmalloc(struct_size(snap, stats, max), GFP_KERNEL);
+    if (snap == NULL)
+    {
+        return NULL;
+    }
+    snap->count = 0;
+
+    rcu_read_lock();
+    for (i = 0; i <= flow_mask && snap->count < max; i++)
+    {
+        struct flow *f;
+
+        hlist_for_each_entry_rcu(f, &flow_buckets[i], node)
+        {
+            struct flow_stat *st = &snap->stats[snap->count];
+            int cpu;
+
+            if (snap->count == max)
+            {
+                break;
+            }
+            st->key = f->key;
+            st->packets = st->bytes = 0;
+            for_each_possible_cpu(cpu)
+            {
+                const struct flow_counters *c = per_cpu_ptr(f->counters, cpu);
+                st->packets += c->packets;
+                st->bytes += c->bytes;
+            }
+            st->first_seen = f->first_seen;
+            st->last_seen = READ_ONCE(f->last_seen);
+            snap->count++;
+        }
+    }
+    rcu_read_unlock();
+
+    sort(snap->stats, snap->count, sizeof(struct flow_stat), flow_stat_cmp, NULL);
+    return snap;
+}
+
+//------------------------------------------------------------------------
+
+/*
+    Netlink event stream
+
+    Subscribers of the "lab3" generic netlink family (lab3_genl.h) get
+    capture records in batches and periodic counter and flow snapshots.
+    Records are collected only while someone listens: each CPU appends to
+    its own batch, which is multicast when it fills up or every
+    genl_flush_ms. A record that can't be sent is counted in genl_drops
+    and reported in every message, so collectors see the loss.
+*/
+
+static unsigned int genl_flush_ms = 100;
+module_param(genl_flush_ms, uint, 0644);
+MODULE_PARM_DESC(genl_flush_ms, "longest delay of a partial netlink record batch");
+
+static unsigned int genl_snapshot_ms = 1000;
+module_param(genl_snapshot_ms, uint, 0644);
+MODULE_PARM_DESC(genl_snapshot_ms, "interval of netlink counter and flow snapshots (0 disables them)");
+
+#define GENL_BATCH 128
+
+struct genl_batch
+{
+    spinlock_t lock;
+    unsigned int count;
+    struct lab3_genl_record records[GENL_BATCH];
+};
+
+static struct genl_batch __percpu *genl_batches;
+static atomic64_t genl_drops = ATOMIC64_INIT(0);
+static struct delayed_work genl_flush_work;
+static struct delayed_work genl_snapshot_work;
+
+static const struct genl_multicast_group genl_mcgrps[] = {
+    {.name = LAB3_GENL_MCGRP},
+};
+
+static struct genl_family genl_family = {
+    .name = LAB3_GENL_NAME,
+    .version = LAB3_GENL_VERSION,
+    .maxattr = LAB3_A_MAX,
+    .module = THIS_MODULE,
+    .mcgrps = genl_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(genl_mcgrps),
+};
+
+static inline bool genl_listening(void)
+{
+    return genl_has_listeners(&genl_family, &init_net, 0);
+}
+
+/* Sends the records of a batch, called with the batch locked */
+static void genl_send_batch(struct genl_batch *batch, gfp_t gfp)
+{
+    size_t len = batch->count * sizeof(struct lab3_genl_record);
+    struct sk_buff *msg;
+    void *hdr;
+    int err;
+
+    if (batch->count == 0)
+    {
+        return;
+    }
+
+    msg = genlmsg_new(nla_total_size(sizeof(u32)) + nla_total_size_64bit(sizeof(u64)) + nla_total_size(len), gfp);
+    if (msg == NULL)
+    {
+        goto drop;
+    }
+    hdr = genlmsg_put(msg, 0, 0, &genl_family, 0, LAB3_CMD_RECORDS);
+    if (hdr == NULL ||
+        nla_put_u32(msg, LAB3_A_NR_RECORDS, batch->count) ||
+        nla_put_u64_64bit(msg, LAB3_A_DROPS, atomic64_read(&genl_drops), LAB3_A_PAD) ||
+        nla_put(msg, LAB3_A_RECORDS, len, batch->records))
+    {
+        nlmsg_free(msg);
+        goto drop;
+    }
+    genlmsg_end(msg, hdr);
+
+    // -ESRCH: the last subscriber left meanwhile, nobody lost anything
+    err = genlmsg_multicast(&genl_family, msg, 0, 0, gfp);
+    if (err != 0 && err != -ESRCH)
+    {
+        goto drop;
+    }
+    batch->count = 0;
+    return;
+
+drop:
+    atomic64_add(batch->count, &genl_drops);
+    batch->count = 0;
+}
+
+/* Called from check_frame for every sampled packet */
+static void genl_record(const struct sk_buff *skb, const struct in6_addr *saddr, const struct in6_addr *daddr)
+{
+    struct genl_batch *batch;
+    struct lab3_genl_record *rec;
+
+    if (!genl_listening())
+    {
+        return;
+    }
+
+    batch = this_cpu_ptr(genl_batches);
+    spin_lock(&batch->lock);
+    rec = &batch->records[batch->count++];
+    rec->ts_ns = ktime_get_real_ns();
+    rec->saddr = *saddr;
+    rec->daddr = *daddr;
+    rec->len = skb->len;
+    rec->ifindex = skb->dev->ifindex;
+    if (batch->count == GENL_BATCH)
+    {
+        genl_send_batch(batch, GFP_ATOMIC);
+    }
+    spin_unlock(&batch->lock);
+}
+
+static void genl_flush(struct work_struct *work)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct genl_batch *batch = per_cpu_ptr(genl_batches, cpu);
+
+        spin_lock_bh(&batch->lock);
+        genl_send_batch(batch, GFP_ATOMIC);
+        spin_unlock_bh(&batch->lock);
+    }
+    schedule_delayed_work(&genl_flush_work, msecs_to_jiffies(max(READ_ONCE(genl_flush_ms), 1U)));
+}
+
+static int genl_put_snapshot(struct sk_buff *msg, const struct flow_snapshot *flows, size_t nr_flows)
+{
+    struct lab3_genl_counters *c;
+    struct lab3_genl_flow *f;
+    struct vni_stats sum;
+    struct nlattr *attr;
+    size_t i;
+
+    fold_stats(&sum);
+    attr = nla_reserve(msg, LAB3_A_COUNTERS, sizeof(*c));
+    if (attr == NULL)
+    {
+        return -EMSGSIZE;
+    }
+    c = nla_data(attr);
+    c->rx_packets = sum.rx_packets;
+    c->rx_bytes = sum.rx_bytes;
+    c->tx_packets = sum.tx_packets;
+    c->tx_bytes = sum.tx_bytes;
+    c->tx_dropped = sum.tx_dropped;
+    c->rx_filtered = sum.filtered;
+    c->rx_malformed = sum.malformed;
+    c->rx_non_ip = sum.non_ip;
+    c->rx_unsampled = sum.unsampled;
+    c->rx_ratelimited = sum.ratelimited;
+
+    attr = nla_reserve(msg, LAB3_A_FLOWS, nr_flows * sizeof(*f));
+    if (attr == NULL)
+    {
+        return -EMSGSIZE;
+    }
+    f = nla_data(attr);
+    for (i = 0; i < nr_flows; i++)
+    {
+        const struct flow_stat *st = &flows->stats[i];
+
+        f[i] = (struct lab3_genl_flow){
+            .saddr = st->key.saddr,
+            .daddr = st->key.daddr,
+            .sport = st->key.sport,
+            .dport = st->key.dport,
+            .proto = st->key.proto,
+            .packets = st->packets,
+            .bytes = st->bytes,
+        };
+    }
+
+    return nla_put_u64_64bit(msg, LAB3_A_DROPS, atomic64_read(&genl_drops), LAB3_A_PAD);
+}
+
+static void genl_snapshot(struct work_struct *work)
+{
+    unsigned int interval = READ_ONCE(genl_snapshot_ms);
+    struct flow_snapshot *flows = NULL;
+    struct sk_buff *msg;
+    size_t nr_flows;
+    void *hdr;
+
+    if (interval == 0 || !genl_listening())
+    {
+        goto out;
+    }
+
+    flows = snapshot_flows();
+    if (flows == NULL)
+    {
+        goto out;
+    }
+    BUILD_BUG_ON(NLA_HDRLEN + TOP_FLOWS_MAX * sizeof(struct lab3_genl_flow) > U16_MAX);
+    nr_flows = min_t(size_t, flows->count, READ_ONCE(top_flows));
+
+    msg = genlmsg_new(nla_total_size(sizeof(struct lab3_genl_counters)) +
+                          nla_total_size(nr_flows * sizeof(struct lab3_genl_flow)) +
+                          nla_total_size_64bit(sizeof(u64)),
+                      GFP_KERNEL);
+    if (msg == NULL)
+    {
+        goto out;
+    }
+    hdr = genlmsg_put(msg, 0, 0, &genl_family, 0, LAB3_CMD_SNAPSHOT);
+    if (hdr == NULL || genl_put_snapshot(msg, flows, nr_flows))
+    {
+        nlmsg_free(msg);
+        goto out;
+    }
+    genlmsg_end(msg, hdr);
+    genlmsg_multicast(&genl_family, msg, 0, 0, GFP_KERNEL);
+
+out:
+    kvfree(flows);
+    schedule_delayed_work(&genl_snapshot_work, msecs_to_jiffies(interval ? interval : 1000));
+}
+
+static int genl_init(void)
+{
+    int cpu, err;
+
+    genl_batches = alloc_percpu(struct genl_batch);
+    if (genl_batches == NULL)
+    {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu)
+    {
+        spin_lock_init(&per_cpu_ptr(genl_batches, cpu)->lock);
+    }
+
+    err = genl_register_family(&genl_family);
+    if (err != 0)
+    {
+        free_percpu(genl_batches);
+        return err;
+    }
+
+    INIT_DELAYED_WORK(&genl_flush_work, genl_flush);
+    INIT_DELAYED_WORK(&genl_snapshot_work, genl_snapshot);
+    schedule_delayed_work(&genl_flush_work, msecs_to_jiffies(max(genl_flush_ms, 1U)));
+    schedule_delayed_work(&genl_snapshot_work, msecs_to_jiffies(genl_snapshot_ms ? genl_snapshot_ms : 1000));
+    return 0;
+}
+
+/* Called once no rx handler can run any more */
+static void genl_cleanup(void)
+{
+    cancel_delayed_work_sync(&genl_flush_work);
+    cancel_delayed_work_sync(&genl_snapshot_work);
+    genl_unregister_family(&genl_family);
+    free_percpu(genl_batches);
+}
+
+//------------------------------------------------------------------------
+
+/*
+    Frame handling
+
+    Headers are read with skb_header_pointer, so nonlinear frames are
+    parsed in place and never linearized. A GRO or GSO frame stands for
+    gso_segs packets on the wire and is counted as that many.
+*/
+
+/* Packets a frame stands for */
+static inline unsigned int frame_segs(const struct sk_buff *skb)
+{
+    return skb_is_gso(skb) ? max_t(unsigned int, skb_shinfo(skb)->gso_segs, 1) : 1;
+}
+
+/* Reads ports, or ICMP type and code, of the L4 header at offset */
+static int parse_l4(const struct sk_buff *skb, int offset, struct flow_key *key)
+{
+    u8 _hdr[4];
+    const u8 *hdr;
+
+    switch (key->proto)
+    {
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+    case IPPROTO_UDPLITE:
+    case IPPROTO_SCTP:
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        break;
+    default:
+        return 0;
+    }
+
+    hdr = skb_header_pointer(skb, offset, sizeof(_hdr), _hdr);
+    if (hdr == NULL)
+    {
+        return -EINVAL;
+    }
+    if (key->proto == IPPROTO_ICMP || key->proto == IPPROTO_ICMPV6)
+    {
+        key->sport = htons(hdr[0]);
+        key->dport = htons(hdr[1]);
+    }
+    else
+    {
+        memcpy(&key->sport, hdr, sizeof(key->sport));
+        memcpy(&key->dport, hdr + 2, sizeof(key->dport));
+    }
+    return 0;
+}
+
+static int parse_ipv4(const struct sk_buff *skb, struct flow_key *key)
+{
+    int offset = skb_network_offset(skb);
+    struct iphdr _ip;
+    const struct iphdr *ip;
+
+    ip = skb_header_pointer(skb, offset, sizeof(_ip), &_ip);
+    if (ip == NULL || ip->version != 4 || ip->ihl < 5)
+    {
+        return -EINVAL;
+    }
+
+    ipv6_addr_set_v4mapped(ip->saddr, &key->saddr);
+    ipv6_addr_set_v4mapped(ip->daddr, &key->daddr);
+    key->proto = ip->protocol;
+    // only the first fragment carries the L4 header
+    if (ip->frag_off & htons(IP_OFFSET))
+    {
+        return 0;
+    }
+    return parse_l4(skb, offset + ip->ihl * 4, key);
+}
+
+static int parse_ipv6(const struct sk_buff *skb, struct flow_key *key)
+{
+    int offset = skb_network_offset(skb);
+    struct ipv6hdr _ip6;
+    const struct ipv6hdr *ip6;
+    __be16 frag_off;
+    u8 nexthdr;
+
+    ip6 = skb_header_pointer(skb, offset, sizeof(_ip6), &_ip6);
+    if (ip6 == NULL || ip6->version != 6)
+    {
+        return -EINVAL;
+    }
+
+    key->saddr = ip6->saddr;
+    key->daddr = ip6->daddr;
+    nexthdr = ip6->nexthdr;
+    offset = ipv6_skip_exthdr(skb, offset + sizeof(_ip6), &nexthdr, &frag_off);
+    if (offset < 0)
+    {
+        return -EINVAL;
+    }
+    key->proto = nexthdr;
+    if (frag_off & htons(~0x7))
+    {
+        return 0;
+    }
+    return parse_l4(skb, offset, key);
+}
+
+enum frame_verdict
+{
+    FRAME_MATCHED,
+    FRAME_FILTERED,
+    FRAME_MALFORMED,
+    FRAME_NOT_IP,
+};
+
+/* Parses the headers into key and applies the filter, no side effects */
+static enum frame_verdict classify_frame(const struct sk_buff *skb, struct flow_key *key)
+{
+    int err;
+
+    switch (skb->protocol)
+    {
+    case htons(ETH_P_IP):
+        err = parse_ipv4(skb, key);
+        break;
+    case htons(ETH_P_IPV6):
+        err = parse_ipv6(skb, key);
+        break;
+    default:
+        return FRAME_NOT_IP;
+    }
+    if (err != 0)
+    {
+        return FRAME_MALFORMED;
+    }
+
+    return filter_match(&key->saddr, &key->daddr) ? FRAME_MATCHED : FRAME_FILTERED;
+}
+
+static enum frame_verdict check_frame(struct sk_buff *skb, unsigned int segs)
+{
+    struct flow_key key = {};
+    enum frame_verdict verdict = classify_frame(skb, &key);
+
+    if (verdict == FRAME_MATCHED)
+    {
+        trace_lab3_frame_matched(skb, &key.saddr, &key.daddr, key.proto, key.sport, key.dport);
+        flow_account(&key, segs, skb->len);
+        if (capture_sample())
+        {
+            capture(skb, &key.saddr, &key.daddr);
+            capture_frame(skb);
+            genl_record(skb, &key.saddr, &key.daddr);
+        }
+    }
+    return verdict;
+}
+
+static rx_handler_result_t handle_frame(struct sk_buff **pskb)
+{
+    struct sk_buff * skb = * pskb;
+    struct vni_stats *st = this_cpu_ptr(stats);
+    struct watched_if *w = rcu_dereference(skb->dev->rx_handler_data);
+    struct watched_if_stats *ws = this_cpu_ptr(w->stats);
+    unsigned int segs = frame_segs(skb);
+    enum frame_verdict verdict;
+
+    // the XDP program has already classified and counted this frame
+    if (READ_ONCE(w->xdp))
+    {
+        u64_stats_update_begin(&ws->syncp);
+        ws->packets += segs;
+        ws->bytes += skb->len;
+        u64_stats_update_end(&ws->syncp);
+        return RX_HANDLER_PASS;
+    }
+
+    verdict = check_frame(skb, segs);
+    trace_lab3_frame_classified(skb, verdict, segs);
+
+    u64_stats_update_begin(&ws->syncp);
+    ws->packets += segs;
+    ws->bytes += skb->len;
+    if (verdict == FRAME_MATCHED)
+    {
+        ws->matched += segs;
+    }
+    u64_stats_update_end(&ws->syncp);
+
+    u64_stats_update_begin(&st->syncp);
+    switch (verdict)
+    {
+    case FRAME_MATCHED:
+        st->rx_packets += segs;
+        st->rx_bytes += skb->len;
+        break;
+    case FRAME_FILTERED:
+        st->filtered += segs;
+        break;
+    case FRAME_MALFORMED:
+        st->malformed += segs;
+        break;
+    case FRAME_NOT_IP:
+        st->non_ip += segs;
+        break;
+    }
+    u64_stats_update_end(&st->syncp);
+    return RX_HANDLER_PASS;
+}
+
+static int open(struct net_device *dev)
+{
+    netif_tx_start_all_queues(dev);
+    pr_info("%s: device opened", dev->name);
+    return 0;
+}
+
+static int stop(struct net_device *dev)
+{
+    netif_tx_stop_all_queues(dev);
+    pr_info("%s: device closed", dev->name);
+    return 0;
+}
+
+/*
+    vni0 has one TX queue per CPU and transmits without the queue lock
+    (LLTX): start_xmit only touches per-CPU counters and hands the skb to
+    the parent, whose own queues serialize the hardware.
+*/
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+static u16 select_queue(struct net_device *dev, struct sk_buff *skb, struct net_device *sb_dev)
+{
+    // the sender's CPU, so concurrent senders never share a qdisc
+    return smp_processor_id() % dev->real_num_tx_queues;
+}
+#endif
+
+static netdev_tx_t start_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+    struct priv *priv = netdev_priv(dev);
+    struct net_device *parent = READ_ONCE(priv->parent);
+    struct vni_stats *st = this_cpu_ptr(stats);
+    unsigned int len = skb->len;
+    int ret = NET_XMIT_DROP;
+
+    if (parent)
+    {
+        skb->dev = parent;
+        skb->priority = 1;
+        ret = dev_queue_xmit(skb);
+    }
+    else
+    {
+        dev_kfree_skb_any(skb);
+    }
+
+    u64_stats_update_begin(&st->syncp);
+    if (net_xmit_eval(ret) == 0)
+    {
+        st->tx_packets++;
+        st->tx_bytes += len;
+    }
+    else
+    {
+        st->tx_dropped++;
+    }
+    u64_stats_update_end(&st->syncp);
+    return NETDEV_TX_OK;
+}
+
+static void get_stats64(struct net_device *dev, struct rtnl_link_stats64 *storage)
+{
+    struct vni_stats sum;
+
+    fold_stats(&sum);
+    storage->rx_packets = sum.rx_packets;
+    storage->rx_bytes = sum.rx_bytes;
+    storage->tx_packets = sum.tx_packets;
+    storage->tx_bytes = sum.tx_bytes;
+    storage->tx_dropped = sum.tx_dropped;
+}
+
+static struct net_device_ops net_device_ops = {
+    .ndo_open = open,
+    .ndo_stop = stop,
+    .ndo_get_stats64 = get_stats64,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+    .ndo_select_queue = select_queue,
+#endif
+    .ndo_start_xmit = start_xmit};
+
+/*
+    Counters that have no place in rtnl_link_stats64, see `ethtool -S vni0`
+*/
+
+static const char ethtool_stat_names[][ETH_GSTRING_LEN] = {
+    "rx_filtered",
+    "rx_malformed",
+    "rx_non_ip",
+    "rx_unsampled",
+    "rx_ratelimited",
+};
+
+static int get_sset_count(struct net_device *dev, int sset)
+{
+    return sset == ETH_SS_STATS ? ARRAY_SIZE(ethtool_stat_names) : -EOPNOTSUPP;
+}
+
+static void get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+    if (sset == ETH_SS_STATS)
+    {
+        memcpy(data, ethtool_stat_names, sizeof(ethtool_stat_names));
+    }
+}
+
+static void get_ethtool_stats(struct net_device *dev, struct ethtool_stats *estats, u64 *data)
+{
+    struct vni_stats sum;
+
+    fold_stats(&sum);
+    data[0] = sum.filtered;
+    data[1] = sum.malformed;
+    data[2] = sum.non_ip;
+    data[3] = sum.unsampled;
+    data[4] = sum.ratelimited;
+}
+
+static const struct ethtool_ops ethtool_ops = {
+    .get_sset_count = get_sset_count,
+    .get_strings = get_strings,
+    .get_ethtool_stats = get_ethtool_stats};
+
+/*
+    Offloads vni0 may advertise. Segmentation and checksums are left to
+    the parent: dev_queue_xmit falls back to software for whatever the
+    parent can't do, so inheriting its flags is always safe.
+*/
+#define VNI_FEATURES (NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_HIGHDMA | NETIF_F_FRAGLIST | \
+                      NETIF_F_GSO_SOFTWARE | NETIF_F_RXCSUM)
+
+static void setup(struct net_device *dev)
+{
+    ether_setup(dev);
+    memset(netdev_priv(dev), 0, sizeof(struct priv));
+    dev->netdev_ops = &net_device_ops;
+    dev->ethtool_ops = &ethtool_ops;
+    dev->hw_features = VNI_FEATURES;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+    dev->lltx = true;
+#else
+    dev->features |= NETIF_F_LLTX;
+#endif
+}
+
+static void inherit_features(struct net_device *dev, const struct net_device *parent)
+{
+    netdev_features_t features = parent->features;
+
+    // any of the parent's checksum offloads is enough to accept CHECKSUM_PARTIAL
+    if (features & NETIF_F_CSUM_MASK)
+    {
+        features |= NETIF_F_HW_CSUM;
+    }
+    dev->features |= features & VNI_FEATURES;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    netif_inherit_tso_max(dev, parent);
+#else
+    netif_set_gso_max_size(dev, parent->gso_max_size);
+    dev->gso_max_segs = parent->gso_max_segs;
+#endif
+}
+
+static int fill_priv(struct priv * priv)
+{
+    priv->parent = __dev_get_by_name(&init_net, link);
+    if (!priv->parent)
+    {
+        pr_err("%s: no such net: %s", THIS_MODULE->name, link);
+        return -ENODEV;
+    }
+
+    if (priv->parent->type != ARPHRD_ETHER && priv->parent->type != ARPHRD_LOOPBACK)
+    {
+        pr_err("%s: illegal net type", THIS_MODULE->name);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------
+
+/*
+    Watched interfaces
+
+    Frames are captured on every interface of init_net whose name matches
+    one of the glob patterns (`watch` parameter, /proc/lab3_ifaces). A
+    netdevice notifier attaches the rx handler to matching interfaces as
+    they are registered or renamed and detaches it before they go away,
+    so an interface that is missing at load time is picked up later.
+    Patterns are protected by rtnl, like the interfaces themselves.
+*/
+
+static char *watch = "lo,enp0s3,enp0s8";
+module_param(watch, charp, 0);
+MODULE_PARM_DESC(watch, "comma separated interface names or glob patterns to capture on");
+
+#define WATCH_PATTERN_LEN 32
+
+struct watch_pattern
+{
+    struct list_head list;
+    char pattern[WATCH_PATTERN_LEN];
+};
+
+static LIST_HEAD(watch_patterns);
+
+static bool watch_wanted(const struct net_device *dev)
+{
+    struct watch_pattern *p;
+
+    ASSERT_RTNL();
+    // never capture on vni0 itself, it only transmits
+    if (!net_eq(dev_net(dev), &init_net) || dev->netdev_ops == &net_device_ops)
+    {
+        return false;
+    }
+    if (dev->type != ARPHRD_ETHER && dev->type != ARPHRD_LOOPBACK)
+    {
+        return false;
+    }
+    list_for_each_entry(p, &watch_patterns, list)
+    {
+        if (glob_match(p->pattern, dev->name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool watch_attached(const struct net_device *dev)
+{
+    return rcu_access_pointer(dev->rx_handler) == handle_frame;
+}
+
+static void watch_attach(struct net_device *dev)
+{
+    struct watched_if *w;
+    int err;
+
+    w = kzalloc(sizeof(*w), GFP_KERNEL);
+    if (w == NULL)
+    {
+        return;
+    }
+    w->stats = netdev_alloc_pcpu_stats(struct watched_if_stats);
+    if (w->stats == NULL)
+    {
+        kfree(w);
+        return;
+    }
+
+    err = netdev_rx_handler_register(dev, handle_frame, w);
+    if (err != 0)
+    {
+        // e.g. a bridge port or the lower device of a macvlan
+        pr_info("%s: can't watch %s, error %i\n", THIS_MODULE->name, dev->name, err);
+        free_percpu(w->stats);
+        kfree(w);
+        return;
+    }
+    pr_info("%s: registered rx handler for %s\n", THIS_MODULE->name, dev->name);
+}
+
+static void watch_detach(struct net_device *dev)
+{
+    struct watched_if *w = rtnl_dereference(dev->rx_handler_data);
+
+    // waits for handlers still running on other CPUs
+    netdev_rx_handler_unregister(dev);
+    free_percpu(w->stats);
+    kfree(w);
+    pr_info("%s: unregistered rx handler for %s\n", THIS_MODULE->name, dev->name);
+}
+
+/*
+    Flags the watched interfaces that run prog as generic XDP, so that
+    handle_frame leaves their frames to it. NULL clears every flag.
+*/
+static void watch_mark_xdp(const struct bpf_prog *prog)
+{
+    struct net_device *dev;
+    struct watched_if *w;
+
+    rtnl_lock();
+    for_each_netdev(&init_net, dev)
+    {
+        if (!watch_attached(dev))
+        {
+            continue;
+        }
+        w = rtnl_dereference(dev->rx_handler_data);
+        WRITE_ONCE(w->xdp, prog != NULL && rcu_access_pointer(dev->xdp_prog) == prog);
+    }
+    rtnl_unlock();
+}
+
+/* Brings every interface in line with the current patterns */
+static void watch_refresh(void)
+{
+    struct net_device *dev;
+
+    ASSERT_RTNL();
+    for_each_netdev(&init_net, dev)
+    {
+        bool wanted = watch_wanted(dev);
+
+        if (wanted && !watch_attached(dev))
+        {
+            watch_attach(dev);
+        }
+        else if (!wanted && watch_attached(dev))
+        {
+            watch_detach(dev);
+        }
+    }
+}
+
+static int watch_event(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+    struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+    struct priv *priv;
+
+    switch (event)
+    {
+    case NETDEV_REGISTER:
+    case NETDEV_CHANGENAME:
+        if (watch_wanted(dev) && !watch_attached(dev))
+        {
+            watch_attach(dev);
+        }
+        else if (event == NETDEV_CHANGENAME && !watch_wanted(dev) && watch_attached(dev))
+        {
+            watch_detach(dev);
+        }
+        break;
+    case NETDEV_UNREGISTER:
+        if (watch_attached(dev))
+        {
+            watch_detach(dev);
+        }
+        // vni0 must not keep transmitting into a device that is going away
+        priv = netdev_priv(child);
+        if (priv->parent == dev)
+        {
+            WRITE_ONCE(priv->parent, NULL);
+        }
+        break;
+    }
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block watch_notifier = {
+    .notifier_call = watch_event,
+};
+
+static void watch_free_patterns(void)
+{
+    struct watch_pattern *p, *tmp;
+
+    list_for_each_entry_safe(p, tmp, &watch_patterns, list)
+    {
+        list_del(&p->list);
+        kfree(p);
+    }
+}
+
+/*
+    Applies one command to the pattern list:
+        add <pattern>  - watch interfaces matching pattern
+        del <pattern>  - remove a pattern added before
+        clear          - remove all patterns
+*/
+static int watch_apply(char *line)
+{
+    char *cmd = strsep(&line, " \t");
+    struct watch_pattern *p, *tmp;
+
+    ASSERT_RTNL();
+    if (strcmp(cmd, "clear") == 0)
+    {
+        watch_free_patterns();
+        return 0;
+    }
+    if (line == NULL)
+    {
+        return -EINVAL;
+    }
+    line = strim(line);
+    if (*line == '\0' || strlen(line) >= WATCH_PATTERN_LEN)
+    {
+        return -EINVAL;
+    }
+
+    if (strcmp(cmd, "add") == 0)
+    {
+        list_for_each_entry(p, &watch_patterns, list)
+        {
+            if (strcmp(p->pattern, line) == 0)
+            {
+                return 0;
+            }
+        }
+        p = kzalloc(sizeof(*p), GFP_KERNEL);
+        if (p == NULL)
+        {
+            return -ENOMEM;
+        }
+        strscpy(p->pattern, line, WATCH_PATTERN_LEN);
+        list_add_tail(&p->list, &watch_patterns);
+        return 0;
+    }
+    if (strcmp(cmd, "del") == 0)
+    {
+        list_for_each_entry_safe(p, tmp, &watch_patterns, list)
+        {
+            if (strcmp(p->pattern, line) == 0)
+            {
+                list_del(&p->list);
+                kfree(p);
+            }
+        }
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/* Runs every line of buf against the pattern list and reattaches handlers */
+static int watch_update(char *buf)
+{
+    char *line;
+    int err = 0;
+
+    rtnl_lock();
+    while ((line = strsep(&buf, "\n")) != NULL)
+    {
+        line = strim(line);
+        if (*line == '\0' || *line == '#')
+        {
+            continue;
+        }
+        if ((err = watch_apply(line)) != 0)
+        {
+            break;
+        }
+    }
+    // commands before a bad line stay applied, like a partial write
+    watch_refresh();
+    rtnl_unlock();
+    return err;
+}
+
+static int watch_init(void)
+{
+    char *patterns, *buf, *name;
+    int err = 0;
+
+    patterns = buf = kstrdup(watch, GFP_KERNEL);
+    if (patterns == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    rtnl_lock();
+    while ((name = strsep(&buf, ",")) != NULL)
+    {
+        char cmd[WATCH_PATTERN_LEN + 4];
+
+        name = strim(name);
+        if (*name == '\0')
+        {
+            continue;
+        }
+        snprintf(cmd, sizeof(cmd), "add %s", name);
+        if ((err = watch_apply(cmd)) != 0)
+        {
+            pr_err("%s: bad watch pattern %s", THIS_MODULE->name, name);
+            break;
+        }
+    }
+    rtnl_unlock();
+    kfree(patterns);
+
+    if (err == 0)
+    {
+        // replays NETDEV_REGISTER for the interfaces that already exist
+        err = register_netdevice_notifier(&watch_notifier);
+    }
+    if (err != 0)
+    {
+        rtnl_lock();
+        watch_free_patterns();
+        rtnl_unlock();
+    }
+    return err;
+}
+
+static void watch_cleanup(void)
+{
+    struct net_device *dev;
+
+    unregister_netdevice_notifier(&watch_notifier);
+
+    rtnl_lock();
+    for_each_netdev(&init_net, dev)
+    {
+        if (watch_attached(dev))
+        {
+            watch_detach(dev);
+        }
+    }
+    watch_free_patterns();
+    rtnl_unlock();
+}
 
 //------------------------------------------------------------------------
 
 /*
-    Virtual network interface structs and functions
+    Proc device structs and functions
 */
 
-static const char * devices[] = {"lo", "enp0s3", "enp0s8"};
-#define devices_size (sizeof(devices) / sizeof(char *))
-
-static char *link = "lo";
-module_param(link, charp, 0);
+/* Formats IPv4-mapped addresses as IPv4, optionally IPv6 ones in brackets */
+static const char *addr_str(char *buf, size_t size, const struct in6_addr *addr, bool brackets)
+{
+    if (ipv6_addr_v4mapped(addr))
+    {
+        snprintf(buf, size, "%pI4", &addr->s6_addr32[3]);
+    }
+    else
+    {
+        snprintf(buf, size, brackets ? "[%pI6c]" : "%pI6c", addr);
+    }
+    return buf;
+}
 
-static char *dest = "127.0.0.11";
-module_param(dest, charp, 0);
+#define ADDR_STR_LEN (INET6_ADDRSTRLEN + 2)
 
-static int dest1 = 127, dest2 = 0, dest3 = 0, dest4 = 11;
+#define PROC_FILE_NAME "var2"
 
-static char *ifname = "vni%d";
+static struct proc_dir_entry *lab3_file;
 
-static struct net_device_stats stats;
+static void *lab3_seq_start(struct seq_file *m, loff_t *pos)
+{
+    struct capture_snapshot *snap = m->private;
+    return *pos < snap->count ? &snap->records[*pos] : NULL;
+}
 
-static struct net_device *child = NULL;
-struct priv
+static void *lab3_seq_next(struct seq_file *m, void *v, loff_t *pos)
 {
-    struct net_device *interfaces[devices_size];
-    struct net_device *parent;
-};
+    ++*pos;
+    return lab3_seq_start(m, pos);
+}
 
-#define MESSAGE_SIZE 4096
-static char message[MESSAGE_SIZE];
-static size_t message_len;
+static void lab3_seq_stop(struct seq_file *m, void *v)
+{
+}
 
-static char check_frame(struct sk_buff *skb, unsigned char data_shift)
+static int lab3_seq_show(struct seq_file *m, void *v)
 {
-    const struct iphdr *ip = (struct iphdr *)skb_network_header(skb);
+    const struct capture_record *rec = v;
+    char saddr[ADDR_STR_LEN], daddr[ADDR_STR_LEN];
+    struct net_device *dev;
+    u32 rem;
+    u64 sec = div_u64_rem(rec->ts, NSEC_PER_SEC, &rem);
+
+    seq_printf(m, "%llu.%06u ", sec, rem / NSEC_PER_USEC);
 
-    const u32 saddr = ntohl(ip->saddr);
-    const u32 daddr = ntohl(ip->daddr);
+    rcu_read_lock();
+    dev = dev_get_by_index_rcu(&init_net, rec->ifindex);
+    if (dev)
+    {
+        seq_printf(m, "%s", dev->name);
+    }
+    else
+    {
+        seq_printf(m, "if%d", rec->ifindex);
+    }
+    rcu_read_unlock();
 
-    const int d1 = daddr >> 24,
-              d2 = (daddr >> 16) & 0x00FF,
-              d3 = (daddr >> 8) & 0x0000FF,
-              d4 = (daddr)&0x000000FF;
+    seq_printf(m, " saddr: %s daddr: %s len: %u\n", addr_str(saddr, sizeof(saddr), &rec->saddr, false),
+               addr_str(daddr, sizeof(daddr), &rec->daddr, false), rec->len);
+    return 0;
+}
 
-    int len = 0;
+static const struct seq_operations lab3_seq_ops = {
+    .start = lab3_seq_start,
+    .next = lab3_seq_next,
+    .stop = lab3_seq_stop,
+    .show = lab3_seq_show};
 
-    if (ip->version == 4 && d1==dest1 && d2==dest2 && d3==dest3 && d4==dest4) {
-        char saddr_str[128];
-        char daddr_str[128];
+static int lab3_open(struct inode *inode, struct file *file)
+{
+    struct capture_snapshot *snap = snapshot_rings();
+    int err;
 
-        len = sprintf(saddr_str, "saddr: %d.%d.%d.%d\n",
-                saddr >> 24,
-                (saddr >> 16) & 0x00FF,
-                (saddr >> 8) & 0x0000FF,
-                (saddr) & 0x000000FF);
+    if (snap == NULL)
+    {
+        return -ENOMEM;
+    }
 
-        len += sprintf(daddr_str, "daddr: %d.%d.%d.%d\n\n", d1, d2, d3, d4);
+    err = seq_open(file, &lab3_seq_ops);
+    if (err)
+    {
+        kvfree(snap);
+        return err;
+    }
+    ((struct seq_file *)file->private_data)->private = snap;
+    return 0;
+}
 
-        pr_info("%s", saddr_str);
-        pr_info("%s", daddr_str);
+static int lab3_release(struct inode *inode, struct file *file)
+{
+    kvfree(((struct seq_file *)file->private_data)->private);
+    return seq_release(inode, file);
+}
 
-        if (message_len + len >= MESSAGE_SIZE) {
-            pr_info("Message buffer is full\n");
-            strcpy(message, saddr_str);
-            message_len = 0;
-        } else {
-            strcat(message, saddr_str);
-        }
-        strcat(message, daddr_str);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define HAVE_PROC_OPS
+#endif
+
+#ifdef HAVE_PROC_OPS
+static const struct proc_ops proc_file_ops = {
+    .proc_open = lab3_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = lab3_release};
+#else
+static const struct file_operations proc_file_ops = {
+    .owner = THIS_MODULE,
+    .open = lab3_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = lab3_release};
+#endif
 
-        message_len += len;
+/*
+    /proc/lab3_flows shows the top_flows largest flows
+*/
 
-        return 1;
-    }
+#define FLOWS_FILE_NAME "lab3_flows"
 
-    return 0;
-}
+static struct proc_dir_entry *flows_file;
 
-static rx_handler_result_t handle_frame(struct sk_buff **pskb)
+static void *flows_seq_start(struct seq_file *m, loff_t *pos)
 {
-    struct sk_buff * skb = * pskb;
-    if (check_frame(skb, 0))
+    struct flow_snapshot *snap = m->private;
+
+    if (*pos == 0)
     {
-        stats.rx_packets++;
-        stats.rx_bytes += skb->len;
+        return SEQ_START_TOKEN;
     }
-    return RX_HANDLER_PASS;
+    return *pos <= min_t(size_t, snap->count, top_flows) ? &snap->stats[*pos - 1] : NULL;
 }
 
-static int open(struct net_device *dev)
+static void *flows_seq_next(struct seq_file *m, void *v, loff_t *pos)
 {
-    netif_start_queue(dev);
-    pr_info("%s: device opened", dev->name);
-    return 0;
+    ++*pos;
+    return flows_seq_start(m, pos);
 }
 
-static int stop(struct net_device *dev)
+static void flows_seq_stop(struct seq_file *m, void *v)
 {
-    netif_stop_queue(dev);
-    pr_info("%s: device closed", dev->name);
-    return 0;
 }
 
-static netdev_tx_t start_xmit(struct sk_buff *skb, struct net_device *dev)
+static int flows_seq_show(struct seq_file *m, void *v)
 {
-    struct priv *priv = netdev_priv(dev);
-
-    stats.tx_packets++;
-    stats.tx_bytes += skb->len;
+    const struct flow_stat *st = v;
+    char saddr[ADDR_STR_LEN], daddr[ADDR_STR_LEN];
 
-    if (priv->parent)
+    if (v == SEQ_START_TOKEN)
     {
-        skb->dev = priv->parent;
-        skb->priority = 1;
-        dev_queue_xmit(skb);
+        struct flow_snapshot *snap = m->private;
+        seq_printf(m, "flows: %zu dropped: %lld\n", snap->count, atomic64_read(&flow_drops));
+        seq_printf(m, "%-5s %-21s    %-21s %12s %16s %8s %8s\n",
+                   "proto", "source", "destination", "packets", "bytes", "age", "idle");
+        return 0;
     }
-    return NETDEV_TX_OK;
-}
 
-static struct net_device_stats *get_stats(struct net_device *dev)
-{
-    return &stats;
+    seq_printf(m, "%-5u %15s:%-5u -> %15s:%-5u %12llu %16llu %8u %8u\n",
+               st->key.proto, addr_str(saddr, sizeof(saddr), &st->key.saddr, true), ntohs(st->key.sport),
+               addr_str(daddr, sizeof(daddr), &st->key.daddr, true), ntohs(st->key.dport), st->packets, st->bytes,
+               jiffies_to_msecs(jiffies - st->first_seen) / 1000,
+               jiffies_to_msecs(jiffies - st->last_seen) / 1000);
+    return 0;
 }
 
-static struct net_device_ops net_device_ops = {
-    .ndo_open = open,
-    .ndo_stop = stop,
-    .ndo_get_stats = get_stats,
-    .ndo_start_xmit = start_xmit};
+static const struct seq_operations flows_seq_ops = {
+    .start = flows_seq_start,
+    .next = flows_seq_next,
+    .stop = flows_seq_stop,
+    .show = flows_seq_show};
 
-static void setup(struct net_device *dev)
+static int flows_open(struct inode *inode, struct file *file)
 {
-    ether_setup(dev);
-    memset(netdev_priv(dev), 0, sizeof(struct priv));
-    dev->netdev_ops = &net_device_ops;
+    struct flow_snapshot *snap = snapshot_flows();
+    int err;
+
+    if (snap == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    err = seq_open(file, &flows_seq_ops);
+    if (err)
+    {
+        kvfree(snap);
+        return err;
+    }
+    ((struct seq_file *)file->private_data)->private = snap;
+    return 0;
 }
 
-static int fill_priv(struct priv * priv)
+#ifdef HAVE_PROC_OPS
+static const struct proc_ops flows_file_ops = {
+    .proc_open = flows_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = lab3_release};
+#else
+static const struct file_operations flows_file_ops = {
+    .owner = THIS_MODULE,
+    .open = flows_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = lab3_release};
+#endif
+
+/*
+    /proc/lab3_filter lists the rules and accepts filter_apply commands
+*/
+
+#define FILTER_FILE_NAME "lab3_filter"
+
+static struct proc_dir_entry *filter_file;
+
+static int filter_show(struct seq_file *m, void *v)
 {
-    int i = 0;
-    for (i = 0; i < devices_size; ++i)
+    const struct filter_table *t;
+    unsigned int i;
+
+    mutex_lock(&filter_lock);
+    t = rcu_dereference_protected(filter, lockdep_is_held(&filter_lock));
+    for (i = 0; t != NULL && i < t->nr_rules; i++)
     {
-        priv->interfaces[i] = __dev_get_by_name(&init_net, devices[i]);
-        if (!priv->interfaces[i])
+        const struct filter_rule *r = &t->rules[i];
+
+        if (ipv6_addr_v4mapped(&r->addr) && r->plen >= 96)
         {
-            pr_err("%s: no such net: %s", THIS_MODULE->name, link);
-            return -ENODEV;
+            seq_printf(m, "%s %pI4/%u %s\n", filter_dir_names[r->dir], &r->addr.s6_addr32[3], r->plen - 96,
+                       filter_action_names[r->action]);
         }
-
-        if (priv->interfaces[i]->type != ARPHRD_ETHER && priv->interfaces[i]->type != ARPHRD_LOOPBACK)
+        else
         {
-            pr_err("%s: illegal net type", THIS_MODULE->name);
-            return -EINVAL;
+            seq_printf(m, "%s %pI6c/%u %s\n", filter_dir_names[r->dir], &r->addr, r->plen,
+                       filter_action_names[r->action]);
         }
     }
+    mutex_unlock(&filter_lock);
+    return 0;
+}
 
-    priv->parent = __dev_get_by_name(&init_net, link);
-    if (!priv->parent)
+static int filter_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, filter_show, NULL);
+}
+
+#define FILTER_LINE_MAX 128 // longest command, sizes the write buffer
+
+/*
+    Applies the whole lines of one write at once. A line cut at the end
+    of the buffer is left unconsumed and the writer resends it with the
+    next chunk, so "cat rules > /proc/lab3_filter" loads a file of any
+    size.
+*/
+static ssize_t filter_write(struct file *file, const char __user *ubuffer, size_t buf_length, loff_t *offset)
+{
+    size_t len = min_t(size_t, buf_length, (size_t)max(READ_ONCE(max_rules), 1U) * FILTER_LINE_MAX);
+    size_t end;
+    char *buf;
+    int err;
+
+    buf = kvmalloc(len + 1, GFP_KERNEL);
+    if (buf == NULL)
     {
-        pr_err("%s: no such net: %s", THIS_MODULE->name, link);
-        return -ENODEV;
+        return -ENOMEM;
+    }
+    if (copy_from_user(buf, ubuffer, len))
+    {
+        kvfree(buf);
+        return -EFAULT;
     }
+    buf[len] = '\0';
 
-    if (priv->parent->type != ARPHRD_ETHER && priv->parent->type != ARPHRD_LOOPBACK)
+    // a buffer without a newline is one command, unless it was cut
+    end = len;
+    while (end > 0 && buf[end - 1] != '\n')
     {
-        pr_err("%s: illegal net type", THIS_MODULE->name);
-        return -EINVAL;
+        end--;
     }
-    return 0;
+    if (end == 0 && len < buf_length)
+    {
+        kvfree(buf);
+        return -E2BIG;
+    }
+    if (end > 0)
+    {
+        len = end;
+        buf[len] = '\0';
+    }
+
+    err = filter_update(buf);
+    kvfree(buf);
+    if (err == 0)
+    {
+        xdp_sync();
+    }
+    return err ? err : len;
 }
 
-int register_handlers(struct priv * priv)
+#ifdef HAVE_PROC_OPS
+static const struct proc_ops filter_file_ops = {
+    .proc_open = filter_open,
+    .proc_read = seq_read,
+    .proc_write = filter_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release};
+#else
+static const struct file_operations filter_file_ops = {
+    .owner = THIS_MODULE,
+    .open = filter_open,
+    .read = seq_read,
+    .write = filter_write,
+    .llseek = seq_lseek,
+    .release = single_release};
+#endif
+
+#define IFACES_FILE_NAME "lab3_ifaces"
+
+static struct proc_dir_entry *ifaces_file;
+
+static int ifaces_show(struct seq_file *m, void *v)
 {
-    int i = 0;
-    int err = 0;
-    for (i = 0; i < devices_size; ++i)
+    struct watch_pattern *p;
+    struct net_device *dev;
+    int cpu;
+
+    rtnl_lock();
+    seq_puts(m, "patterns:");
+    list_for_each_entry(p, &watch_patterns, list)
     {
-        rtnl_lock();
-        err = netdev_rx_handler_register(priv->interfaces[i], handle_frame, NULL);
-        rtnl_unlock();
-        if (err != 0) {
-            pr_info("error on registering handler for device %s\n", devices[i]);
-            return err;
+        seq_printf(m, " %s", p->pattern);
+    }
+    seq_printf(m, "\n%-16s %8s %12s %16s %12s\n", "interface", "ifindex", "packets", "bytes", "matched");
+
+    for_each_netdev(&init_net, dev)
+    {
+        const struct watched_if *w;
+        u64 packets = 0, bytes = 0, matched = 0;
+
+        if (!watch_attached(dev))
+        {
+            continue;
         }
+        w = rtnl_dereference(dev->rx_handler_data);
+        for_each_possible_cpu(cpu)
+        {
+            const struct watched_if_stats *ws = per_cpu_ptr(w->stats, cpu);
+            struct watched_if_stats tmp;
+            unsigned int start;
+
+            do
+            {
+                start = u64_stats_fetch_begin(&ws->syncp);
+                tmp = *ws;
+            } while (u64_stats_fetch_retry(&ws->syncp, start));
+
+            packets += tmp.packets;
+            bytes += tmp.bytes;
+            matched += tmp.matched;
+        }
+        seq_printf(m, "%-16s %8d %12llu %16llu %12llu\n", dev->name, dev->ifindex, packets, bytes, matched);
     }
+    rtnl_unlock();
     return 0;
 }
 
-void unregister_handlers(struct priv * priv)
+static int ifaces_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, ifaces_show, NULL);
+}
+
+static ssize_t ifaces_write(struct file *file, const char __user *ubuffer, size_t buf_length, loff_t *offset)
 {
-    int i = 0;
-    for (i = 0; i < devices_size; ++i)
+    char *buf;
+    int err;
+
+    if (buf_length >= PAGE_SIZE)
     {
-        rtnl_lock();
-        netdev_rx_handler_unregister(priv->interfaces[i]);
-        rtnl_unlock();
+        return -E2BIG;
     }
+
+    buf = memdup_user_nul(ubuffer, buf_length);
+    if (IS_ERR(buf))
+    {
+        return PTR_ERR(buf);
+    }
+
+    err = watch_update(buf);
+    kfree(buf);
+    return err ? err : buf_length;
 }
 
-//------------------------------------------------------------------------
+#ifdef HAVE_PROC_OPS
+static const struct proc_ops ifaces_file_ops = {
+    .proc_open = ifaces_open,
+    .proc_read = seq_read,
+    .proc_write = ifaces_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release};
+#else
+static const struct file_operations ifaces_file_ops = {
+    .owner = THIS_MODULE,
+    .open = ifaces_open,
+    .read = seq_read,
+    .write = ifaces_write,
+    .llseek = seq_lseek,
+    .release = single_release};
+#endif
 
-/*
-    Proc device structs and functions
-*/
+#define XDP_FILE_NAME "lab3_xdp"
 
-#define PROC_FILE_NAME "var2"
+static struct proc_dir_entry *xdp_file;
 
-static struct proc_dir_entry *lab3_file;
+static int xdp_show(struct seq_file *m, void *v)
+{
+    struct lab3_xdp_counters sum;
+
+    mutex_lock(&filter_lock);
+    if (xdp.prog == NULL)
+    {
+        seq_puts(m, "prog: none\n");
+    }
+    else
+    {
+        xdp_fold_counters(&sum);
+        seq_printf(m, "prog: %s\n", xdp.path);
+        seq_printf(m, "rx_packets: %llu\nrx_bytes: %llu\nrx_filtered: %llu\nrx_malformed: %llu\nrx_non_ipv4: %llu\n",
+                   sum.packets, sum.bytes, sum.filtered, sum.malformed, sum.non_ipv4);
+    }
+    mutex_unlock(&filter_lock);
+    return 0;
+}
+
+static int xdp_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, xdp_show, NULL);
+}
 
-static ssize_t lab3_read(struct file *file_ptr, char __user *ubuffer, size_t buf_length, loff_t *offset)
+/*
+    Accepts "attach <pinned program path>" or "detach". Attach after the
+    program is on the interfaces: only those are left to it.
+*/
+static ssize_t xdp_write(struct file *file, const char __user *ubuffer, size_t buf_length, loff_t *offset)
 {
-    int len = min(message_len - (size_t)*offset, buf_length);
+    char *buf, *line, *cmd;
+    int err = -EINVAL;
 
-    pr_info("Proc file read\n");
+    if (buf_length >= PAGE_SIZE)
+    {
+        return -E2BIG;
+    }
 
-    if (len <= 0)
+    buf = memdup_user_nul(ubuffer, buf_length);
+    if (IS_ERR(buf))
     {
-        pr_info("All done\n");
-        return 0;
+        return PTR_ERR(buf);
     }
 
-    if (copy_to_user(ubuffer, message + *offset, len))
+    line = strim(buf);
+    cmd = strsep(&line, " \t");
+    mutex_lock(&filter_lock);
+    if (strcmp(cmd, "attach") == 0 && line != NULL)
     {
-        pr_info("Didnt copy buffer message\n");
-        return -EFAULT;
+        err = xdp_attach(strim(line));
+    }
+    else if (strcmp(cmd, "detach") == 0)
+    {
+        xdp_detach();
+        err = 0;
     }
+    // a failed attach leaves no program either
+    watch_mark_xdp(xdp.prog);
+    mutex_unlock(&filter_lock);
 
-    *offset += len;
-    return len;
+    kfree(buf);
+    return err ? err : buf_length;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
-#define HAVE_PROC_OPS
-#endif
-
 #ifdef HAVE_PROC_OPS
-static const struct proc_ops proc_file_ops = {
-    .proc_read = lab3_read};
+static const struct proc_ops xdp_file_ops = {
+    .proc_open = xdp_open,
+    .proc_read = seq_read,
+    .proc_write = xdp_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release};
 #else
-static const struct file_operations proc_file_ops = {
+static const struct file_operations xdp_file_ops = {
     .owner = THIS_MODULE,
-    .read = lab3_read};
+    .open = xdp_open,
+    .read = seq_read,
+    .write = xdp_write,
+    .llseek = seq_lseek,
+    .release = single_release};
 #endif
 
 //------------------------------------------------------------------------
@@ -265,73 +3127,156 @@ int __init lab3_init(void)
 {
     int err = 0;
     struct priv *priv;
-    u32 dest_addr = ntohl(in_aton(dest));
+    char *rule;
+
+    rule = kasprintf(GFP_KERNEL, "add dst %s", dest);
+    if (rule == NULL)
+    {
+        return -ENOMEM;
+    }
+    err = filter_update(rule);
+    kfree(rule);
+    if (err != 0)
+    {
+        pr_err("%s: bad dest %s", THIS_MODULE->name, dest);
+        goto err_filter;
+    }
+    pr_info("Init addr: %s\n", dest);
+
+    err = alloc_rings();
+    if (err != 0)
+    {
+        pr_err("%s: can't allocate capture rings", THIS_MODULE->name);
+        goto err_rings;
+    }
+
+    err = flow_init();
+    if (err != 0)
+    {
+        pr_err("%s: can't allocate flow table", THIS_MODULE->name);
+        goto err_flows;
+    }
+
+    stats = netdev_alloc_pcpu_stats(struct vni_stats);
+    if (stats == NULL)
+    {
+        err = -ENOMEM;
+        goto err_flows;
+    }
+
+    err = capture_dev_init();
+    if (err != 0)
+    {
+        pr_err("%s: can't create capture device", THIS_MODULE->name);
+        goto err_flows;
+    }
+
+    err = genl_init();
+    if (err != 0)
+    {
+        pr_err("%s: can't register netlink family", THIS_MODULE->name);
+        goto err_flows;
+    }
 
-    child = alloc_netdev(sizeof(struct priv), ifname, NET_NAME_UNKNOWN, setup);
+    child = alloc_netdev_mqs(sizeof(struct priv), ifname, NET_NAME_UNKNOWN, setup, num_possible_cpus(), 1);
     
     if (child == NULL)
     {
         pr_err("%s: allocate error", THIS_MODULE->name);
-        return -ENOMEM;
+        err = -ENOMEM;
+        goto err_genl;
     }
     
     priv = netdev_priv(child);
     err = fill_priv(priv);
     if (err !=0) {
-        free_netdev(child);
-        return err;
+        goto err_netdev;
     }
 
     // copy IP, MAC and other information
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+    eth_hw_addr_set(child, priv->parent->dev_addr);
+#else
     memcpy(child->dev_addr, priv->parent->dev_addr, ETH_ALEN);
+#endif
     memcpy(child->broadcast, priv->parent->broadcast, ETH_ALEN);
+    inherit_features(child, priv->parent);
     
-    if ((err = dev_alloc_name(child, child->name)))
+    if ((err = dev_alloc_name(child, child->name)) < 0)
     {
         pr_err("%s: allocate name, error %i", THIS_MODULE->name, err);
-        free_netdev(child);
-        return -EIO;
+        err = -EIO;
+        goto err_netdev;
     }
 
-    err = register_handlers(priv);
+    err = watch_init();
     if (err !=0) {
-        free_netdev(child);
-        return err;
+        goto err_netdev;
     }
 
     register_netdev(child);
 
     lab3_file = proc_create(PROC_FILE_NAME, 0444, NULL, &proc_file_ops);
+    filter_file = proc_create(FILTER_FILE_NAME, 0644, NULL, &filter_file_ops);
+    flows_file = proc_create(FLOWS_FILE_NAME, 0444, NULL, &flows_file_ops);
+    ifaces_file = proc_create(IFACES_FILE_NAME, 0644, NULL, &ifaces_file_ops);
+    xdp_file = proc_create(XDP_FILE_NAME, 0644, NULL, &xdp_file_ops);
 
-    if (lab3_file == NULL)
+    if (lab3_file == NULL || filter_file == NULL || flows_file == NULL || ifaces_file == NULL ||
+        xdp_file == NULL)
     {
         pr_alert("Can not create file for some reason\n");
-        unregister_handlers(priv);
-        unregister_netdev(child);
-        free_netdev(child);
-        return -1;
+        err = -ENOMEM;
+        goto err_proc;
     }
 
-    dest1 = dest_addr >> 24;
-    dest2 = (dest_addr >> 16) & 0x00FF;
-    dest3 = (dest_addr >> 8) & 0x0000FF;
-    dest4 = (dest_addr) & 0x000000FF;
-    pr_info("Init addr: %d.%d.%d.%d\n", dest1, dest2, dest3, dest4);
-
     pr_info("Module %s loaded", THIS_MODULE->name);
     pr_info("%s: create link %s", THIS_MODULE->name, child->name);
-    pr_info("%s: registered rx handler for %s", THIS_MODULE->name, priv->parent->name);
     return 0;
+
+err_proc:
+    proc_remove(xdp_file);
+    proc_remove(ifaces_file);
+    proc_remove(flows_file);
+    proc_remove(filter_file);
+    proc_remove(lab3_file);
+    watch_cleanup();
+    unregister_netdev(child);
+err_netdev:
+    free_netdev(child);
+err_genl:
+    genl_cleanup();
+err_flows:
+    capture_dev_cleanup();
+    free_percpu(stats);
+    flow_cleanup();
+err_rings:
+    free_rings();
+err_filter:
+    xdp_cleanup();
+    filter_cleanup();
+    return err;
 }
 
 void __exit lab3_exit(void)
 {
-    struct priv *priv = netdev_priv(child);
+    proc_remove(xdp_file);
+    proc_remove(ifaces_file);
+    proc_remove(flows_file);
+    proc_remove(filter_file);
     proc_remove(lab3_file);
-    unregister_handlers(priv);
+    watch_cleanup();
 
     unregister_netdev(child);
     free_netdev(child);
+    // netdev_rx_handler_unregister waited for running handlers
+    genl_cleanup();
+    capture_dev_cleanup();
+    free_percpu(stats);
+    flow_cleanup();
+    free_rings();
+    xdp_cleanup();
+    filter_cleanup();
     pr_info("Module %s unloaded", THIS_MODULE->name);
 }
 
@@ -345,6 +3290,10 @@ MODULE_AUTHOR("luribina");
 MODULE_DESCRIPTION("io lab3");
 MODULE_VERSION("1.0");
 
+#ifdef LAB3_KUNIT
+#include "lab3_test.c"
+#endif
+
 
 //      |\      _,,,---,,_
 //      /,`.-'`'    -.  ;-;;,_
@@ -0,0 +1,56 @@
+/*
+ * Layout of the /dev/lab3_capture mapping, shared with userspace.
+ *
+ * The mapping starts with one page holding struct lab3_capture_info,
+ * followed by info.nr_rings rings of info.ring_bytes each, one per CPU.
+ * A ring is a struct lab3_capture_ring header followed, at
+ * info.slot_offset, by info.nr_slots slots of info.slot_size bytes.
+ * The kernel only advances producer, the reader only advances consumer;
+ * record i lives in slot i % nr_slots.
+ *
+ * The info page (offset 0) can only be mapped read-only. Map the rings
+ * separately, read-write, starting at offset one page. The kernel keeps
+ * its own copy of the layout and of producer, so writes to the mapping
+ * can only confuse the reader itself.
+ */
+
+#ifndef LAB3_CAPTURE_H
+#define LAB3_CAPTURE_H
+
+#include <linux/types.h>
+
+#define LAB3_CAPTURE_MAGIC 0x6c616233 /* "lab3" */
+#define LAB3_CAPTURE_VERSION 2
+
+struct lab3_capture_info
+{
+    __u32 magic;
+    __u32 version;
+    __u32 nr_rings;
+    __u32 ring_bytes;
+    __u32 nr_slots;
+    __u32 slot_size;
+    __u32 snaplen;
+    __u32 linktype; /* pcap link type of the captured data */
+    __u32 slot_offset;
+    __u32 reserved;
+};
+
+struct lab3_capture_ring
+{
+    __u64 producer __attribute__((aligned(64)));
+    __u64 drops;    /* records lost because the ring was full */
+    __u64 consumer __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct lab3_capture_slot
+{
+    __u64 ts_ns;   /* CLOCK_REALTIME */
+    __u32 caplen;  /* bytes in data */
+    __u32 len;     /* length of the frame on the wire */
+    __s32 ifindex;
+    __u32 reserved;
+    __u8 data[];   /* frame from the link layer header, caplen bytes */
+};
+
+#endif
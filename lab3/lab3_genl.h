@@ -0,0 +1,84 @@
+/*
+ * Generic netlink family "lab3", shared with userspace.
+ *
+ * Subscribers join the LAB3_GENL_MCGRP group and receive two kinds of
+ * messages:
+ *   LAB3_CMD_RECORDS  - a batch of capture records, LAB3_A_RECORDS holds
+ *                       LAB3_A_NR_RECORDS struct lab3_genl_record;
+ *   LAB3_CMD_SNAPSHOT - every genl_snapshot_ms: LAB3_A_COUNTERS with a
+ *                       struct lab3_genl_counters and LAB3_A_FLOWS with
+ *                       the top_flows largest flows as struct lab3_genl_flow.
+ * Both carry LAB3_A_DROPS, the number of records the module could not
+ * send since it was loaded. A subscriber that reads too slowly gets
+ * ENOBUFS from recv() instead.
+ *
+ * Addresses are IPv6, IPv4 ones are mapped (::ffff:a.b.c.d).
+ */
+
+#ifndef LAB3_GENL_H
+#define LAB3_GENL_H
+
+#include <linux/in6.h>
+#include <linux/types.h>
+
+#define LAB3_GENL_NAME "lab3"
+#define LAB3_GENL_VERSION 2
+#define LAB3_GENL_MCGRP "events"
+
+enum lab3_genl_cmd
+{
+    LAB3_CMD_UNSPEC,
+    LAB3_CMD_RECORDS,
+    LAB3_CMD_SNAPSHOT,
+    __LAB3_CMD_MAX,
+};
+
+enum lab3_genl_attr
+{
+    LAB3_A_UNSPEC,
+    LAB3_A_PAD,
+    LAB3_A_DROPS,      /* u64 */
+    LAB3_A_NR_RECORDS, /* u32 */
+    LAB3_A_RECORDS,    /* array of struct lab3_genl_record */
+    LAB3_A_COUNTERS,   /* struct lab3_genl_counters */
+    LAB3_A_FLOWS,      /* array of struct lab3_genl_flow */
+    __LAB3_A_MAX,
+};
+
+#define LAB3_A_MAX (__LAB3_A_MAX - 1)
+
+struct lab3_genl_record
+{
+    __u64 ts_ns; /* CLOCK_REALTIME */
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+    __u32 len;
+    __s32 ifindex;
+};
+
+struct lab3_genl_counters
+{
+    __u64 rx_packets;
+    __u64 rx_bytes;
+    __u64 tx_packets;
+    __u64 tx_bytes;
+    __u64 tx_dropped;
+    __u64 rx_filtered;
+    __u64 rx_malformed;
+    __u64 rx_non_ip;
+    __u64 rx_unsampled;
+    __u64 rx_ratelimited;
+};
+
+struct lab3_genl_flow
+{
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+    __be16 sport; /* ICMP type for ICMP and ICMPv6 */
+    __be16 dport; /* ICMP code */
+    __u32 proto;
+    __u64 packets;
+    __u64 bytes;
+};
+
+#endif
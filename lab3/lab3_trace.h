@@ -0,0 +1,86 @@
+/*
+ * Tracepoints of lab3, system "lab3".
+ *
+ * frame_classified fires in the rx handler for every frame it classifies,
+ * with the verdict of check_frame. frame_matched fires as well for frames
+ * that passed the filter and carries their flow. skbaddr matches the one
+ * of net:netif_receive_skb, which trace/latency.bt uses as the start of
+ * the classification.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lab3
+
+#if !defined(LAB3_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LAB3_TRACE_H
+
+#include <linux/in6.h>
+#include <linux/skbuff.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lab3_frame_classified,
+
+    TP_PROTO(const struct sk_buff *skb, int verdict, unsigned int segs),
+
+    TP_ARGS(skb, verdict, segs),
+
+    TP_STRUCT__entry(
+        __field(const void *, skbaddr)
+        __field(int, ifindex)
+        __field(u16, protocol)
+        __field(unsigned int, len)
+        __field(unsigned int, segs)
+        __field(int, verdict)
+    ),
+
+    TP_fast_assign(
+        __entry->skbaddr = skb;
+        __entry->ifindex = skb->dev->ifindex;
+        __entry->protocol = ntohs(skb->protocol);
+        __entry->len = skb->len;
+        __entry->segs = segs;
+        __entry->verdict = verdict;
+    ),
+
+    TP_printk("skbaddr=%p ifindex=%d protocol=0x%04x len=%u segs=%u verdict=%d", __entry->skbaddr,
+              __entry->ifindex, __entry->protocol, __entry->len, __entry->segs, __entry->verdict)
+);
+
+TRACE_EVENT(lab3_frame_matched,
+
+    TP_PROTO(const struct sk_buff *skb, const struct in6_addr *saddr, const struct in6_addr *daddr,
+             u8 proto, __be16 sport, __be16 dport),
+
+    TP_ARGS(skb, saddr, daddr, proto, sport, dport),
+
+    TP_STRUCT__entry(
+        __field(const void *, skbaddr)
+        __array(u8, saddr, sizeof(struct in6_addr))
+        __array(u8, daddr, sizeof(struct in6_addr))
+        __field(u8, proto)
+        __field(u16, sport)
+        __field(u16, dport)
+        __field(unsigned int, len)
+    ),
+
+    TP_fast_assign(
+        __entry->skbaddr = skb;
+        memcpy(__entry->saddr, saddr, sizeof(__entry->saddr));
+        memcpy(__entry->daddr, daddr, sizeof(__entry->daddr));
+        __entry->proto = proto;
+        __entry->sport = ntohs(sport);
+        __entry->dport = ntohs(dport);
+        __entry->len = skb->len;
+    ),
+
+    TP_printk("skbaddr=%p %pI6c:%u -> %pI6c:%u proto=%u len=%u", __entry->skbaddr, __entry->saddr,
+              __entry->sport, __entry->daddr, __entry->dport, __entry->proto, __entry->len)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lab3_trace
+#include <trace/define_trace.h>
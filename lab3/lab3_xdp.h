@@ -0,0 +1,41 @@
+/*
+ * Maps shared by the XDP program in xdp/lab3_xdp.bpf.c and lab3.ko.
+ *
+ * The module finds the maps by name among the maps used by the pinned
+ * program. It keeps LAB3_XDP_SRC_MAP and LAB3_XDP_DST_MAP in sync with
+ * /proc/lab3_filter and reads LAB3_XDP_COUNTERS_MAP, a per-CPU array
+ * with a single struct lab3_xdp_counters.
+ */
+
+#ifndef LAB3_XDP_H
+#define LAB3_XDP_H
+
+#include <linux/types.h>
+
+#define LAB3_XDP_SRC_MAP "lab3_src"
+#define LAB3_XDP_DST_MAP "lab3_dst"
+#define LAB3_XDP_COUNTERS_MAP "lab3_counters"
+
+#define LAB3_XDP_MAX_RULES 65536
+
+/* Values of the filter maps, same meaning as in /proc/lab3_filter */
+#define LAB3_XDP_WATCH 1
+#define LAB3_XDP_IGNORE 2
+
+/* LPM trie key: prefixlen in bits, then the address in network order */
+struct lab3_xdp_key
+{
+    __u32 prefixlen;
+    __be32 addr;
+};
+
+struct lab3_xdp_counters
+{
+    __u64 packets; /* frames that passed the filter */
+    __u64 bytes;
+    __u64 filtered;
+    __u64 malformed;
+    __u64 non_ipv4;
+};
+
+#endif
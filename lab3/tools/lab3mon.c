@@ -0,0 +1,281 @@
+/*
+ * Prints the lab3 generic netlink event stream.
+ *
+ *     lab3mon [-r] [-s]
+ *
+ * -r prints only capture records, -s only snapshots. Uses plain netlink
+ * sockets, no libnl needed.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../lab3_genl.h"
+
+#define BUF_SIZE (1 << 16)
+
+#define NLA_OK(nla, rem) ((rem) >= (int)sizeof(struct nlattr) && (nla)->nla_len >= sizeof(struct nlattr) && \
+                          (nla)->nla_len <= (rem))
+#define NLA_NEXT(nla, rem) ((rem) -= NLA_ALIGN((nla)->nla_len), \
+                            (struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+#define NLA_DATA(nla) ((void *)((char *)(nla) + NLA_HDRLEN))
+#define NLA_LEN(nla) ((nla)->nla_len - NLA_HDRLEN)
+
+static char buf[BUF_SIZE];
+
+/* Asks the controller for the family id and the id of its multicast group */
+static int resolve(int fd, uint16_t *family, uint32_t *group)
+{
+    struct
+    {
+        struct nlmsghdr nh;
+        struct genlmsghdr gh;
+        char attrs[64];
+    } req = {0};
+    struct nlattr *nla = (struct nlattr *)req.attrs;
+    struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+    int len, rem;
+
+    nla->nla_type = CTRL_ATTR_FAMILY_NAME;
+    nla->nla_len = NLA_HDRLEN + sizeof(LAB3_GENL_NAME);
+    memcpy(NLA_DATA(nla), LAB3_GENL_NAME, sizeof(LAB3_GENL_NAME));
+
+    req.nh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(nla->nla_len));
+    req.nh.nlmsg_type = GENL_ID_CTRL;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.gh.cmd = CTRL_CMD_GETFAMILY;
+    req.gh.version = 1;
+
+    if (send(fd, &req, req.nh.nlmsg_len, 0) < 0)
+    {
+        return -1;
+    }
+    len = recv(fd, buf, sizeof(buf), 0);
+    if (len < 0 || !NLMSG_OK(nh, len) || nh->nlmsg_type == NLMSG_ERROR)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    *family = 0;
+    *group = 0;
+    rem = nh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    for (nla = (struct nlattr *)((char *)NLMSG_DATA(nh) + GENL_HDRLEN); NLA_OK(nla, rem); nla = NLA_NEXT(nla, rem))
+    {
+        if (nla->nla_type == CTRL_ATTR_FAMILY_ID)
+        {
+            *family = *(uint16_t *)NLA_DATA(nla);
+        }
+        else if (nla->nla_type == CTRL_ATTR_MCAST_GROUPS)
+        {
+            // nested: one entry per group, each with a name and an id
+            struct nlattr *grp = NLA_DATA(nla);
+            int grem = NLA_LEN(nla);
+
+            for (; NLA_OK(grp, grem); grp = NLA_NEXT(grp, grem))
+            {
+                struct nlattr *a = NLA_DATA(grp);
+                int arem = NLA_LEN(grp);
+                uint32_t id = 0;
+                int match = 0;
+
+                for (; NLA_OK(a, arem); a = NLA_NEXT(a, arem))
+                {
+                    if (a->nla_type == CTRL_ATTR_MCAST_GRP_ID)
+                    {
+                        id = *(uint32_t *)NLA_DATA(a);
+                    }
+                    else if (a->nla_type == CTRL_ATTR_MCAST_GRP_NAME)
+                    {
+                        match = strcmp(NLA_DATA(a), LAB3_GENL_MCGRP) == 0;
+                    }
+                }
+                if (match)
+                {
+                    *group = id;
+                }
+            }
+        }
+    }
+    if (*family == 0 || *group == 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/* IPv4-mapped addresses are printed as IPv4 */
+static const char *addr_str(const struct in6_addr *addr, char *buf, size_t size)
+{
+    if (IN6_IS_ADDR_V4MAPPED(addr))
+    {
+        return inet_ntop(AF_INET, &addr->s6_addr[12], buf, size);
+    }
+    return inet_ntop(AF_INET6, addr, buf, size);
+}
+
+static void print_records(const struct lab3_genl_record *rec, uint32_t nr)
+{
+    char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+    uint32_t i;
+
+    for (i = 0; i < nr; i++)
+    {
+        printf("%llu.%06llu if%d saddr: %s daddr: %s len: %u\n", (unsigned long long)(rec[i].ts_ns / 1000000000),
+               (unsigned long long)(rec[i].ts_ns % 1000000000 / 1000), rec[i].ifindex,
+               addr_str(&rec[i].saddr, saddr, sizeof(saddr)), addr_str(&rec[i].daddr, daddr, sizeof(daddr)),
+               rec[i].len);
+    }
+}
+
+static void print_snapshot(const struct lab3_genl_counters *c, const struct lab3_genl_flow *flows, size_t nr)
+{
+    char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+    size_t i;
+
+    if (c != NULL)
+    {
+        printf("counters: rx %llu pkts %llu bytes, filtered %llu, malformed %llu, non-ip %llu, "
+               "unsampled %llu, ratelimited %llu\n",
+               (unsigned long long)c->rx_packets, (unsigned long long)c->rx_bytes,
+               (unsigned long long)c->rx_filtered, (unsigned long long)c->rx_malformed,
+               (unsigned long long)c->rx_non_ip, (unsigned long long)c->rx_unsampled,
+               (unsigned long long)c->rx_ratelimited);
+    }
+    for (i = 0; i < nr; i++)
+    {
+        printf("  flow %s:%u -> %s:%u proto %u: %llu pkts %llu bytes\n",
+               addr_str(&flows[i].saddr, saddr, sizeof(saddr)), ntohs(flows[i].sport),
+               addr_str(&flows[i].daddr, daddr, sizeof(daddr)), ntohs(flows[i].dport), flows[i].proto,
+               (unsigned long long)flows[i].packets, (unsigned long long)flows[i].bytes);
+    }
+}
+
+static void handle(struct nlmsghdr *nh, int show_records, int show_snapshots)
+{
+    struct genlmsghdr *gh = NLMSG_DATA(nh);
+    struct nlattr *nla = (struct nlattr *)((char *)gh + GENL_HDRLEN);
+    int rem = nh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    const struct lab3_genl_record *records = NULL;
+    const struct lab3_genl_counters *counters = NULL;
+    const struct lab3_genl_flow *flows = NULL;
+    size_t nr_records = 0, nr_flows = 0;
+    static uint64_t last_drops;
+    uint64_t drops = 0;
+
+    for (; NLA_OK(nla, rem); nla = NLA_NEXT(nla, rem))
+    {
+        switch (nla->nla_type)
+        {
+        case LAB3_A_DROPS:
+            memcpy(&drops, NLA_DATA(nla), sizeof(drops));
+            break;
+        case LAB3_A_RECORDS:
+            records = NLA_DATA(nla);
+            nr_records = NLA_LEN(nla) / sizeof(*records);
+            break;
+        case LAB3_A_COUNTERS:
+            if (NLA_LEN(nla) >= (int)sizeof(*counters))
+            {
+                counters = NLA_DATA(nla);
+            }
+            break;
+        case LAB3_A_FLOWS:
+            flows = NLA_DATA(nla);
+            nr_flows = NLA_LEN(nla) / sizeof(*flows);
+            break;
+        }
+    }
+
+    if (drops != last_drops)
+    {
+        fprintf(stderr, "lab3mon: %llu records dropped by the kernel\n", (unsigned long long)(drops - last_drops));
+        last_drops = drops;
+    }
+    if (gh->cmd == LAB3_CMD_RECORDS && show_records)
+    {
+        print_records(records, nr_records);
+    }
+    else if (gh->cmd == LAB3_CMD_SNAPSHOT && show_snapshots)
+    {
+        print_snapshot(counters, flows, nr_flows);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int show_records = 1, show_snapshots = 1;
+    struct sockaddr_nl sa = {.nl_family = AF_NETLINK};
+    uint16_t family;
+    uint32_t group;
+    int fd, opt, len, rcvbuf = 4 << 20;
+
+    while ((opt = getopt(argc, argv, "rs")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            show_snapshots = 0;
+            break;
+        case 's':
+            show_records = 0;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r] [-s]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        perror("netlink");
+        return 1;
+    }
+    if (resolve(fd, &family, &group) < 0)
+    {
+        perror("family " LAB3_GENL_NAME);
+        return 1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0)
+    {
+        perror("join group");
+        return 1;
+    }
+
+    for (;;)
+    {
+        struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+
+        len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0)
+        {
+            if (errno == ENOBUFS)
+            {
+                // this reader fell behind, the kernel dropped messages for it
+                fprintf(stderr, "lab3mon: receive buffer overrun\n");
+                continue;
+            }
+            perror("recv");
+            return 1;
+        }
+        for (; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+        {
+            if (nh->nlmsg_type == family)
+            {
+                handle(nh, show_records, show_snapshots);
+            }
+        }
+    }
+}
@@ -0,0 +1,207 @@
+/*
+ * Drains the /dev/lab3_capture rings into a pcap file.
+ *
+ *     lab3pcap [-d device] [-c count] <file.pcap>
+ *
+ * Runs until count frames were written or until SIGINT/SIGTERM, then
+ * prints how many frames the kernel dropped because the rings were full.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../lab3_capture.h"
+
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+struct pcap_file_header
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void *map_capture(int fd, struct lab3_capture_info *info, size_t *size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    void *area = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (area == MAP_FAILED)
+    {
+        return NULL;
+    }
+    memcpy(info, area, sizeof(*info));
+    munmap(area, page);
+
+    if (info->magic != LAB3_CAPTURE_MAGIC || info->version != LAB3_CAPTURE_VERSION)
+    {
+        fprintf(stderr, "unexpected capture layout\n");
+        errno = EPROTO;
+        return NULL;
+    }
+
+    // the rings follow the read-only info page
+    *size = (size_t)info->nr_rings * info->ring_bytes;
+    area = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page);
+    return area == MAP_FAILED ? NULL : area;
+}
+
+/* Writes every pending record of one ring, returns how many */
+static unsigned long drain_ring(const struct lab3_capture_info *info, struct lab3_capture_ring *ring,
+                                FILE *out, unsigned long limit)
+{
+    uint64_t prod = __atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE);
+    uint64_t cons = ring->consumer;
+    unsigned long n = 0;
+
+    while (cons != prod && n < limit)
+    {
+        const struct lab3_capture_slot *slot = (const void *)((const char *)ring + info->slot_offset +
+                                                              (cons & (info->nr_slots - 1)) * info->slot_size);
+        struct pcap_record_header rec = {
+            .ts_sec = slot->ts_ns / 1000000000ULL,
+            .ts_nsec = slot->ts_ns % 1000000000ULL,
+            .caplen = slot->caplen,
+            .len = slot->len,
+        };
+
+        fwrite(&rec, sizeof(rec), 1, out);
+        fwrite(slot->data, 1, slot->caplen, out);
+        cons++;
+        n++;
+    }
+
+    // hand the slots back to the kernel only after they were copied out
+    __atomic_store_n(&ring->consumer, cons, __ATOMIC_RELEASE);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "/dev/lab3_capture";
+    unsigned long count = 0, written = 0;
+    struct lab3_capture_info info;
+    struct pcap_file_header hdr;
+    uint64_t drops = 0;
+    size_t size;
+    void *area;
+    FILE *out;
+    int fd, opt;
+    unsigned int i;
+
+    while ((opt = getopt(argc, argv, "d:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        goto usage;
+    }
+
+    fd = open(device, O_RDWR);
+    if (fd < 0)
+    {
+        perror(device);
+        return 1;
+    }
+
+    area = map_capture(fd, &info, &size);
+    if (area == NULL)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    out = fopen(argv[optind], "wb");
+    if (out == NULL)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    hdr = (struct pcap_file_header){
+        .magic = PCAP_MAGIC_NSEC,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = info.snaplen,
+        .linktype = info.linktype,
+    };
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    while (!stop && (count == 0 || written < count))
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        unsigned long n = 0;
+
+        for (i = 0; i < info.nr_rings; i++)
+        {
+            struct lab3_capture_ring *ring = (void *)((char *)area + (size_t)i * info.ring_bytes);
+            n += drain_ring(&info, ring, out, count ? count - written - n : (unsigned long)-1);
+        }
+        written += n;
+
+        // nothing pending: sleep until a wakeup, the timeout picks up stragglers
+        if (n == 0 && poll(&pfd, 1, 100) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+    }
+
+    for (i = 0; i < info.nr_rings; i++)
+    {
+        struct lab3_capture_ring *ring = (void *)((char *)area + (size_t)i * info.ring_bytes);
+        drops += __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+    }
+
+    fclose(out);
+    munmap(area, size);
+    close(fd);
+    fprintf(stderr, "%lu frames written, %llu dropped by the kernel\n", written, (unsigned long long)drops);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-d device] [-c count] <file.pcap>\n", argv[0]);
+    return 1;
+}
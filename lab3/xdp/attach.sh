@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Loads xdp/lab3_xdp.o, attaches it as generic XDP to the given
+# interfaces and switches lab3.ko to XDP mode.
+#
+#   xdp/attach.sh <iface>...      attach
+#   xdp/attach.sh -d <iface>...   detach and return to the rx handler
+#
+# Requires bpftool, iproute2 and a mounted bpffs.
+
+set -eu
+
+cd "$(dirname "$0")"
+
+PIN=${PIN:-/sys/fs/bpf/lab3_xdp}
+
+if [ "${1:-}" = "-d" ]; then
+    shift
+    echo detach > /proc/lab3_xdp
+    for dev in "$@"; do
+        ip link set dev "$dev" xdpgeneric off
+    done
+    rm -f "$PIN"
+    exit 0
+fi
+
+[ $# -gt 0 ] || { echo "usage: $0 [-d] <iface>..." >&2; exit 1; }
+[ -f lab3_xdp.o ] || { echo "build the program first (make xdp)" >&2; exit 1; }
+
+if [ ! -e "$PIN" ]; then
+    bpftool prog load lab3_xdp.o "$PIN" type xdp
+fi
+for dev in "$@"; do
+    ip link set dev "$dev" xdpgeneric pinned "$PIN"
+done
+echo "attach $PIN" > /proc/lab3_xdp
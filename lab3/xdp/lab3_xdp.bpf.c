@@ -0,0 +1,83 @@
+/*
+ * XDP version of lab3's frame classification: the same IPv4 checks and
+ * longest-prefix filter as check_frame(), run before an skb is built.
+ * Every frame is passed on; the program only counts.
+ *
+ * Build with `make xdp`, attach with xdp/attach.sh.
+ */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+#include "../lab3_xdp.h"
+
+struct
+{
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, LAB3_XDP_MAX_RULES);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct lab3_xdp_key);
+    __type(value, __u32);
+} lab3_src SEC(".maps"), lab3_dst SEC(".maps");
+
+struct
+{
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct lab3_xdp_counters);
+} lab3_counters SEC(".maps");
+
+static __always_inline int watched(void *map, __be32 addr)
+{
+    struct lab3_xdp_key key = {.prefixlen = 32, .addr = addr};
+    __u32 *action = bpf_map_lookup_elem(map, &key);
+
+    return action != NULL && *action == LAB3_XDP_WATCH;
+}
+
+SEC("xdp")
+int lab3_xdp(struct xdp_md *ctx)
+{
+    void *data = (void *)(long)ctx->data;
+    void *data_end = (void *)(long)ctx->data_end;
+    struct ethhdr *eth = data;
+    struct lab3_xdp_counters *c;
+    struct iphdr *ip;
+    __u32 zero = 0;
+
+    c = bpf_map_lookup_elem(&lab3_counters, &zero);
+    if (c == NULL)
+    {
+        return XDP_PASS;
+    }
+
+    if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP))
+    {
+        c->non_ipv4++;
+        return XDP_PASS;
+    }
+
+    ip = (void *)(eth + 1);
+    if ((void *)(ip + 1) > data_end || ip->version != 4 || ip->ihl < 5)
+    {
+        c->malformed++;
+        return XDP_PASS;
+    }
+
+    if (watched(&lab3_dst, ip->daddr) || watched(&lab3_src, ip->saddr))
+    {
+        c->packets++;
+        c->bytes += data_end - (void *)ip;
+    }
+    else
+    {
+        c->filtered++;
+    }
+    return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Runs the KUnit suites of lab1, lab2 and lab3 under UML, no VM or root
+# needed. Builds a UML kernel with tests/uml.config, builds the modules
+# against it with KUNIT=y and boots it with the host root mounted
+# read-only through hostfs; the suites run when init loads the modules.
+# kunit.py parses each module's KTAP output and the run fails if any
+# test or any insmod did. The *_bench suites print ns/op lines.
+#
+# Optional:
+#   KSRC=~/src/linux  - clean kernel source tree, linux-$KVER is downloaded
+#                       otherwise; the build goes to OUT
+#   KVER=6.12         - version to download
+#   OUT=tests/.kunit  - build directory, kept between runs
+#   JOBS=$(nproc) MEM=512M TIMEOUT=600
+#   MODULES="lab1 lab2 lab3"
+
+set -eu
+
+cd "$(dirname "$0")/.."
+top=$(pwd)
+
+: "${KVER:=6.12}"
+: "${OUT:=$top/tests/.kunit}"
+: "${JOBS:=$(nproc)}"
+: "${MEM:=512M}"
+: "${TIMEOUT:=600}"
+: "${MODULES:=lab1 lab2 lab3}"
+
+mkdir -p "$OUT"
+OUT=$(cd "$OUT" && pwd)
+
+if [ -z "${KSRC:-}" ]; then
+    KSRC=$OUT/linux-$KVER
+    if [ ! -f "$KSRC/Makefile" ]; then
+        echo "fetching linux-$KVER"
+        curl -fL "https://cdn.kernel.org/pub/linux/kernel/v${KVER%%.*}.x/linux-$KVER.tar.xz" | tar -xJ -C "$OUT"
+    fi
+fi
+build=$OUT/build
+
+# the UML kernel, rebuilt only when the tree or the options change
+if [ ! -f "$build/.config" ] || [ tests/uml.config -nt "$build/.config" ]; then
+    make -C "$KSRC" O="$build" ARCH=um defconfig
+    "$KSRC/scripts/kconfig/merge_config.sh" -m -O "$build" "$build/.config" tests/uml.config
+    make -C "$KSRC" O="$build" ARCH=um olddefconfig
+fi
+make -C "$KSRC" O="$build" ARCH=um -j"$JOBS"
+
+# the modules, built out of the source directories
+for lab in $MODULES; do
+    rm -rf "$OUT/$lab"
+    cp -r "$lab" "$OUT/$lab"
+    make -C "$build" ARCH=um M="$OUT/$lab" KUNIT=y -j"$JOBS" modules
+done
+
+# init runs from the read-only host root, markers split the log per module
+cat > "$OUT/init" <<EOF
+#!/bin/sh
+export PATH=/sbin:/bin:/usr/sbin:/usr/bin
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t devtmpfs devtmpfs /dev
+for ko in $(for lab in $MODULES; do ls "$OUT/$lab"/*.ko; done | tr '\n' ' '); do
+    echo "lab-kunit: load \$ko" > /dev/kmsg
+    insmod "\$ko" || echo "lab-kunit: insmod \$ko failed" > /dev/kmsg
+done
+echo "lab-kunit: end" > /dev/kmsg
+echo o > /proc/sysrq-trigger
+EOF
+chmod +x "$OUT/init"
+
+log=$OUT/kunit.log
+timeout "$TIMEOUT" "$build/linux" mem="$MEM" console=tty rootfstype=hostfs rootflags=/ ro \
+    init="$OUT/init" < /dev/null > "$log" 2>&1 || true
+
+grep -q "lab-kunit: end" "$log" || { echo "UML did not finish, see $log" >&2; exit 1; }
+
+status=0
+if grep "lab-kunit: insmod .* failed" "$log" >&2; then
+    status=1
+fi
+rm -f "$OUT"/*.ktap
+awk -v out="$OUT" '
+    /lab-kunit: load / { n++; file = sprintf("%s/%d.ktap", out, n); next }
+    /lab-kunit: end/ { file = "" }
+    file != "" { print > file }
+' "$log"
+for ktap in "$OUT"/*.ktap; do
+    [ -f "$ktap" ] || continue
+    python3 "$KSRC/tools/testing/kunit/kunit.py" parse "$ktap" || status=1
+done
+# kunit.py only shows the diagnostics of failed tests
+grep -h "ns/op" "$OUT"/*.ktap 2>/dev/null | sed 's/^.*# //' || true
+exit $status